@@ -8,12 +8,39 @@
  * Copyright (C) 2020 Johannes Cornelis Draaijer
  */
 
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
 #include <linux/i2c.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#include <linux/kref.h>
 #include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
 #include <linux/unaligned.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <net/genetlink.h>
+
+#include "am2320.h"
+
+#define CREATE_TRACE_POINTS
+#include "am2320_trace.h"
 
 #define AM2320_MEAS_SIZE	4
 #define AM2320_FRAME_SIZE	AM2320_MEAS_SIZE + 4
@@ -24,62 +51,531 @@
 #define AM2320_DEFAULT_MIN_POLL_INTERVAL	2000
 #define AM2320_MIN_POLL_INTERVAL		2000
 
+/*
+ * Backoff after failed refreshes (in milliseconds)
+ */
+#define AM2320_BACKOFF_MIN	100
+#define AM2320_BACKOFF_MAX	60000
+
 /*
  * I2C command delays (in microseconds)
  */
 #define AM2320_MEAS_DELAY	1500
 
+/*
+ * Adaptive conversion delay (in microseconds)
+ */
+#define AM2320_MEAS_DELAY_MIN		500
+#define AM2320_MEAS_DELAY_MAX		3000
+#define AM2320_MEAS_DELAY_STEP		10
+#define AM2320_MEAS_DELAY_BACKOFF	500
+#define AM2320_MEAS_DELAY_MARGIN	200
+#define AM2320_MEAS_DELAY_SLACK		100
+
+/*
+ * Sensor range, limits are clamped to it
+ */
+#define AM2320_TEMP_MIN		-40000
+#define AM2320_TEMP_MAX		80000
+#define AM2320_HUMIDITY_MIN	0
+#define AM2320_HUMIDITY_MAX	100000
+
+/*
+ * Default hysteresis of the thresholds
+ */
+#define AM2320_TEMP_HYST	1000
+#define AM2320_HUMIDITY_HYST	2000
+
+/*
+ * Saturation vapour pressure table (in millidegrees and millipascal)
+ */
+#define AM2320_SVP_TEMP_MIN	-80000
+#define AM2320_SVP_TEMP_STEP	2000
+
+/*
+ * Filtering, the window is set through the samples attribute
+ */
+#define AM2320_FILTER_MAX_SAMPLES	16
+#define AM2320_FILTER_EMA_SHIFT		8
+
+enum am2320_filter_type {
+	AM2320_FILTER_NONE,
+	AM2320_FILTER_AVERAGE,
+	AM2320_FILTER_MEDIAN,
+	AM2320_FILTER_EMA,
+};
+
 /*
  * Command bytes
  */
 #define AM2320_FUNC_READ	0x03
 #define AM2320_FUNC_WRITE	0x10
 
+static bool background;
+module_param(background, bool, 0444);
+MODULE_PARM_DESC(background,
+		 "Refresh samples from a background worker so that reads never wait on the bus");
+
+static bool measure_ahead;
+module_param(measure_ahead, bool, 0444);
+MODULE_PARM_DESC(measure_ahead,
+		 "Start the next conversion right after each read, samples are one interval old");
+
+static bool adaptive_delay;
+module_param(adaptive_delay, bool, 0444);
+MODULE_PARM_DESC(adaptive_delay,
+		 "Learn the shortest conversion delay each sensor needs");
+
+static unsigned int temp_deadband;
+module_param(temp_deadband, uint, 0644);
+MODULE_PARM_DESC(temp_deadband,
+		 "Only notify temp1_input pollers of changes larger than this (millidegrees)");
+
+static unsigned int humidity_deadband;
+module_param(humidity_deadband, uint, 0644);
+MODULE_PARM_DESC(humidity_deadband,
+		 "Only notify humidity1_input pollers of changes larger than this (millipercent)");
+
+static int am2320_filter_set(const char *val, const struct kernel_param *kp)
+{
+	return param_set_uint_minmax(val, kp, AM2320_FILTER_NONE,
+				     AM2320_FILTER_EMA);
+}
+
+static const struct kernel_param_ops am2320_filter_ops = {
+	.set = am2320_filter_set,
+	.get = param_get_uint,
+};
+
+static unsigned int filter;
+module_param_cb(filter, &am2320_filter_ops, &filter, 0444);
+MODULE_PARM_DESC(filter,
+		 "Smooth samples over the samples attribute: 0 = none, 1 = moving average, 2 = median, 3 = EMA");
+
+static unsigned int max_retries = 2;
+module_param(max_retries, uint, 0644);
+MODULE_PARM_DESC(max_retries,
+		 "Measure again up to this many times when a frame is corrupted");
+
+static unsigned int retry_budget_ms = 50;
+module_param(retry_budget_ms, uint, 0644);
+MODULE_PARM_DESC(retry_budget_ms,
+		 "Don't start another measurement after this long into a refresh (ms)");
+
+static unsigned int stale_grace_ms;
+module_param(stale_grace_ms, uint, 0644);
+MODULE_PARM_DESC(stale_grace_ms,
+		 "When a refresh fails, return the last good sample while it is younger than this (ms, must exceed update_interval)");
+
+static bool iio;
+module_param(iio, bool, 0444);
+MODULE_PARM_DESC(iio, "Also register an IIO device with a triggered buffer");
+
+static bool netlink;
+module_param(netlink, bool, 0444);
+MODULE_PARM_DESC(netlink,
+		 "Multicast every sample on the \"am2320\" generic netlink family");
+
+/**
+ *   struct am2320_sample - A consistent snapshot of the latest sample
+ *   @temperature: The temperature in millidegrees
+ *   @humidity: The relative humidity in millipercent
+ *   @time: The time the sample was taken, 0 until the first sample landed
+ *   @dew_point: The dew point in millidegrees
+ *   @absolute_humidity: The absolute humidity in mg/m^3
+ *   @status: The result of the latest refresh, 0 or a negative errno
+ *   @seq: Incremented on every refresh, successful or not
+ *   @backoff_until: Until when a failed @status is returned without retrying
+ */
+struct am2320_sample {
+	int temperature;
+	int humidity;
+	int dew_point;
+	int absolute_humidity;
+	ktime_t time;
+	int status;
+	u32 seq;
+	ktime_t backoff_until;
+};
+
+enum am2320_channel {
+	AM2320_CHAN_TEMP,
+	AM2320_CHAN_HUMIDITY,
+	AM2320_NUM_CHANNELS,
+};
+
+enum am2320_history_kind {
+	AM2320_HIST_LOWEST,
+	AM2320_HIST_HIGHEST,
+	AM2320_HIST_AVERAGE,
+};
+
+/**
+ *   struct am2320_history - Running statistics of a channel
+ *   @lowest: The lowest value since the last reset
+ *   @highest: The highest value since the last reset
+ *   @sum: The sum of all values since the last reset
+ *   @count: The number of values since the last reset
+ */
+struct am2320_history {
+	int lowest;
+	int highest;
+	s64 sum;
+	u32 count;
+};
+
+/**
+ *   struct am2320_filter - Filter state of a channel
+ *   @window: The last raw values, a ring buffer
+ *   @next: The index in @window the next value goes to
+ *   @fill: The number of valid values in @window
+ *   @ema: The exponential moving average, shifted by AM2320_FILTER_EMA_SHIFT
+ */
+struct am2320_filter {
+	int window[AM2320_FILTER_MAX_SAMPLES];
+	unsigned int next;
+	unsigned int fill;
+	s64 ema;
+};
+
+enum am2320_stat {
+	AM2320_STAT_CACHE_HITS,
+	AM2320_STAT_REFRESHES,
+	AM2320_STAT_COALESCED_READS,
+	AM2320_STAT_BACKOFF_HITS,
+	AM2320_STAT_FAILURES,
+	AM2320_STAT_RETRIES,
+	AM2320_STAT_CRC_ERRORS,
+	AM2320_STAT_HEADER_ERRORS,
+	AM2320_STAT_SHORT_READS,
+	AM2320_STAT_ADAPTER_ERRORS,
+	AM2320_NUM_STATS,
+};
+
+static const char * const am2320_stat_names[AM2320_NUM_STATS] = {
+	[AM2320_STAT_CACHE_HITS] = "cache_hits",
+	[AM2320_STAT_REFRESHES] = "refreshes",
+	[AM2320_STAT_COALESCED_READS] = "coalesced_reads",
+	[AM2320_STAT_BACKOFF_HITS] = "backoff_hits",
+	[AM2320_STAT_FAILURES] = "failures",
+	[AM2320_STAT_RETRIES] = "retries",
+	[AM2320_STAT_CRC_ERRORS] = "crc_errors",
+	[AM2320_STAT_HEADER_ERRORS] = "header_errors",
+	[AM2320_STAT_SHORT_READS] = "short_reads",
+	[AM2320_STAT_ADAPTER_ERRORS] = "adapter_errors",
+};
+
+/* Bucket n counts durations below 2^n us, the last one everything above */
+#define AM2320_LATENCY_BUCKETS	24
+
+/**
+ *   struct am2320_stats - Statistics, updated without taking any lock
+ *   @counters: Event counters, indexed by enum am2320_stat
+ *   @refresh_latency: Histogram of the time a refresh took
+ *   @lock_wait: Histogram of the time spent waiting for the refresh lock
+ */
+struct am2320_stats {
+	atomic64_t counters[AM2320_NUM_STATS];
+	atomic64_t refresh_latency[AM2320_LATENCY_BUCKETS];
+	atomic64_t lock_wait[AM2320_LATENCY_BUCKETS];
+};
+
+enum am2320_limit {
+	AM2320_LIMIT_TEMP_MIN,
+	AM2320_LIMIT_TEMP_MAX,
+	AM2320_LIMIT_TEMP_CRIT,
+	AM2320_LIMIT_HUMIDITY_MIN,
+	AM2320_LIMIT_HUMIDITY_MAX,
+	AM2320_NUM_LIMITS,
+};
+
+enum am2320_limit_attr {
+	AM2320_LIMIT_VALUE,
+	AM2320_LIMIT_HYST,
+	AM2320_LIMIT_ALARM,
+};
+
+/**
+ *   struct am2320_limit_info - Description of a threshold
+ *   @type: The hwmon sensor type the threshold applies to
+ *   @attr: The hwmon attribute of the threshold
+ *   @hyst: The hwmon attribute of the threshold's hysteresis
+ *   @alarm: The hwmon attribute of the matching alarm
+ *   @low: Whether the alarm triggers below the threshold rather than above
+ *   @initial: The default threshold, which never triggers
+ *   @name: The name of the threshold's sysfs attribute
+ */
+struct am2320_limit_info {
+	enum hwmon_sensor_types type;
+	u32 attr;
+	u32 hyst;
+	u32 alarm;
+	bool low;
+	int initial;
+	const char *name;
+};
+
+static const struct am2320_limit_info am2320_limits[AM2320_NUM_LIMITS] = {
+	[AM2320_LIMIT_TEMP_MIN] = {
+		hwmon_temp, hwmon_temp_min, hwmon_temp_min_hyst,
+		hwmon_temp_min_alarm,
+		true, AM2320_TEMP_MIN, "temp1_min",
+	},
+	[AM2320_LIMIT_TEMP_MAX] = {
+		hwmon_temp, hwmon_temp_max, hwmon_temp_max_hyst,
+		hwmon_temp_max_alarm,
+		false, AM2320_TEMP_MAX, "temp1_max",
+	},
+	[AM2320_LIMIT_TEMP_CRIT] = {
+		hwmon_temp, hwmon_temp_crit, hwmon_temp_crit_hyst,
+		hwmon_temp_crit_alarm,
+		false, AM2320_TEMP_MAX, "temp1_crit",
+	},
+	[AM2320_LIMIT_HUMIDITY_MIN] = {
+		hwmon_humidity, hwmon_humidity_min, hwmon_humidity_min_hyst,
+		hwmon_humidity_min_alarm,
+		true, AM2320_HUMIDITY_MIN, "humidity1_min",
+	},
+	[AM2320_LIMIT_HUMIDITY_MAX] = {
+		hwmon_humidity, hwmon_humidity_max, hwmon_humidity_max_hyst,
+		hwmon_humidity_max_alarm,
+		false, AM2320_HUMIDITY_MAX, "humidity1_max",
+	},
+};
+
+/*
+ * Generic netlink family multicasting samples, its ABI is in am2320.h
+ */
+enum am2320_genl_mcgrp {
+	AM2320_MCGRP_SAMPLES,
+};
+
+static const struct genl_multicast_group am2320_genl_mcgrps[] = {
+	[AM2320_MCGRP_SAMPLES] = { .name = AM2320_GENL_MCGRP_SAMPLES },
+};
+
+static struct genl_family am2320_genl_family = {
+	.name = AM2320_GENL_NAME,
+	.version = AM2320_GENL_VERSION,
+	.maxattr = AM2320_ATTR_MAX,
+	.module = THIS_MODULE,
+	.mcgrps = am2320_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(am2320_genl_mcgrps),
+};
+
 /**
  *   struct am2320_data - All the data required to operate an AM2320 chip
+ *   @node: Entry in am2320_devices
  *   @client: The i2c client associated with the AM2320
+ *   @hwmon_dev: The hwmon device, used to notify pollers of new samples
  *   @lock: A mutex that is used to prevent parallel access to the i2c client
+ *   @seq: Seqcount publishing temperature, humidity and previous_poll_time
+ *         to lock-free readers, serialized by @lock
  *   @min_poll_interval: The minimum poll interval
  *                       The datasheet specifies a minimum sample rate of
  * 			 2000 ms. Default value is 2000 ms
  *   @previous_poll_time: The previous time that the AM2320 was polled
  *   @temperature: The latest temperature value received from the AM2320
  *   @humidity: The latest humidity value received from the AM2320
+ *   @dew_point: The dew point derived from the latest sample
+ *   @absolute_humidity: The absolute humidity derived from the latest sample
+ *   @status: The result of the latest refresh
+ *   @sample_seq: Incremented on every refresh, successful or not
+ *   @failures: Number of consecutive failed refreshes
+ *   @backoff_ms: The current backoff after a failed refresh
+ *   @backoff_until: Until when the last error is returned without retrying
+ *   @notified_temperature: The temperature pollers were last notified of
+ *   @notified_humidity: The humidity pollers were last notified of
+ *   @limits: The thresholds, indexed by enum am2320_limit
+ *   @hyst: The hysteresis of each threshold, relative to it and never negative
+ *   @alarms: Bitmap of the active alarms, indexed by enum am2320_limit
+ *   @samples: The filter window size, 1 disables filtering
+ *   @filter: Filter state, indexed by enum am2320_channel
+ *   @history: Running statistics, indexed by enum am2320_channel, published
+ *             under @seq
+ *   @ignore_nak: Whether the adapter can batch the wake-up with the command
+ *   @sample_xfers: Number of adapter transactions the last refresh took
+ *   @bus_held_ns: Time the last refresh held the bus
+ *   @bus_idle_ns: Time the last refresh left the bus idle while converting
+ *   @meas_delay: The learned conversion delay in microseconds, without margin
+ *   @armed: Whether a conversion was started ahead of the next refresh
+ *   @armed_time: The boottime the conversion was started ahead, which is
+ *                the time of the sample it yields
+ *   @work: Background worker refreshing the sample every poll interval
+ *   @cdev: The character device, which may outlive the sensor
+ *   @flight_lock: Protects the in-flight refresh state below
+ *   @in_flight: Whether a reader is currently refreshing the sample
+ *   @flight_gen: Incremented whenever an in-flight refresh has finished
+ *   @flight_wq: Woken up whenever an in-flight refresh has finished
+ *   @flight_res: The result of the last refresh, handed to all waiters
+ *   @stats: Statistics exposed in debugfs
  */
 
 struct am2320_data {
+	struct list_head node;
 	struct i2c_client *client;
+	struct device *hwmon_dev;
 	/*
 	 * Prevent simultaneous access to the i2c
 	 * client and previous_poll_time
 	 */
 	struct mutex lock;
+	seqcount_mutex_t seq;
 	ktime_t min_poll_interval;
 	ktime_t previous_poll_time;
 	int temperature;
 	int humidity;
+	int dew_point;
+	int absolute_humidity;
+	int status;
+	u32 sample_seq;
+	u32 failures;
+	u32 backoff_ms;
+	ktime_t backoff_until;
+	int notified_temperature;
+	int notified_humidity;
+	int limits[AM2320_NUM_LIMITS];
+	int hyst[AM2320_NUM_LIMITS];
+	unsigned long alarms;
+	u32 samples;
+	struct am2320_filter filter[AM2320_NUM_CHANNELS];
+	struct am2320_history history[AM2320_NUM_CHANNELS];
+	bool ignore_nak;
+	u32 sample_xfers;
+	u64 bus_held_ns;
+	u64 bus_idle_ns;
+	u32 meas_delay;
+	bool armed;
+	ktime_t armed_time;
+	struct delayed_work work;
+	struct am2320_cdev *cdev;
+	spinlock_t flight_lock;
+	bool in_flight;
+	u32 flight_gen;
+	wait_queue_head_t flight_wq;
+	int flight_res;
+	struct am2320_stats stats;
+};
+
+/**
+ *   struct am2320_cdev - Character device state, which outlives the sensor
+ *   @kref: Held by the sensor and by every open file
+ *   @miscdev: The character device streaming binary records
+ *   @data: The sensor, only valid until @gone is set
+ *   @gone: Set once the sensor is unbound, open files then fail with -ENODEV
+ *   @users: Number of open files, which keep the sensor's worker running
+ *   @lock: Protects @record
+ *   @record: The latest record, published on every refresh
+ *   @sample_wq: Woken up on every refresh and when the sensor goes away
+ *   @shared: The page userspace can map to read samples without syscalls
+ */
+struct am2320_cdev {
+	struct kref kref;
+	struct miscdevice miscdev;
+	struct am2320_data *data;
+	bool gone;
+	atomic_t users;
+	spinlock_t lock;
+	struct am2320_record record;
+	wait_queue_head_t sample_wq;
+	struct am2320_shared *shared;
 };
 
+static void am2320_stat_inc(struct am2320_data *data, enum am2320_stat stat)
+{
+	atomic64_inc(&data->stats.counters[stat]);
+}
+
+/*
+ * am2320_latency_add() - account a duration in a log2 histogram
+ * @hist: the histogram
+ * @start: when the measured operation started
+ */
+static void am2320_latency_add(atomic64_t *hist, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	unsigned int bucket = 0;
+
+	if (us > 0)
+		bucket = min(ilog2(us) + 1, AM2320_LATENCY_BUCKETS - 1);
+
+	atomic64_inc(&hist[bucket]);
+}
+
+/*
+ * am2320_sample_get() - read the latest sample without taking the lock
+ * @data: the data to read the sample from
+ * @sample: where to store the snapshot
+ */
+static void am2320_sample_get(struct am2320_data *data,
+			      struct am2320_sample *sample)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&data->seq);
+		sample->temperature = data->temperature;
+		sample->humidity = data->humidity;
+		sample->dew_point = data->dew_point;
+		sample->absolute_humidity = data->absolute_humidity;
+		sample->time = data->previous_poll_time;
+		sample->status = data->status;
+		sample->seq = data->sample_seq;
+		sample->backoff_until = data->backoff_until;
+	} while (read_seqcount_retry(&data->seq, seq));
+}
+
+/*
+ * All bound sensors, for the driver-wide view in debugfs
+ */
+static LIST_HEAD(am2320_devices);
+static DEFINE_MUTEX(am2320_devices_lock);
+static struct dentry *am2320_debugfs_root;
+
 /*
  * am2320_polltime_expired() - check if the minimum poll interval has expired
- * @data: the data containing the time to compare
+ * @data: the data containing the poll interval
+ * @sample: the sample containing the time to compare
  * Return: 1 if the minimum poll interval has expired, 0 if not
  */
-static int am2320_polltime_expired(struct am2320_data *data)
+static int am2320_polltime_expired(struct am2320_data *data,
+				   struct am2320_sample *sample)
 {
 	ktime_t current_time = ktime_get_boottime();
-	ktime_t difference = ktime_sub(current_time, data->previous_poll_time);
+	ktime_t difference = ktime_sub(current_time, sample->time);
 
 	return ktime_after(difference, data->min_poll_interval);
 }
 
 /*
- * am2320_crc16() - calculate crc of the sensor's measurements
+ * am2320_sample_age() - time since the sample was taken
+ * @sample: the sample to check
+ * Return: the age in milliseconds
+ */
+static s64 am2320_sample_age(struct am2320_sample *sample)
+{
+	return ktime_ms_delta(ktime_get_boottime(), sample->time);
+}
+
+/*
+ * am2320_backing_off() - check if the last refresh failed recently
+ * @sample: the sample containing the status and backoff to check
+ * Return: true if the last error should be returned without retrying
+ */
+static bool am2320_backing_off(struct am2320_sample *sample)
+{
+	return sample->status < 0 &&
+	       ktime_before(ktime_get_boottime(), sample->backoff_until);
+}
+
+/*
+ * am2320_crc16_bitwise() - calculate crc of the sensor's measurements
  * @raw_data: data frame received from sensor, excluding the crc
  * @count: size of the data frame
+ * Reference implementation, one bit at a time.
  * Return: the calculated crc
  */
-static int am2320_crc16(u8 *raw_data, int count)
+static int __maybe_unused am2320_crc16_bitwise(u8 *raw_data, int count)
 {
 	u16 crc = 0xFFFF;
 	while (count--) {
@@ -96,63 +592,311 @@ static int am2320_crc16(u8 *raw_data, int count)
 	return crc;
 }
 
+#ifdef AM2320_CRC16_BITWISE
+static int am2320_crc16(u8 *raw_data, int count)
+{
+	return am2320_crc16_bitwise(raw_data, count);
+}
+#else
+/*
+ * Modbus CRC16 (reflected polynomial 0xA001) of every possible byte
+ */
+static const u16 am2320_crc16_table[256] = {
+	0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+	0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+	0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+	0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+	0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+	0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+	0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+	0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+	0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+	0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+	0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+	0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+	0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+	0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+	0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+	0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+	0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+	0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+	0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+	0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+	0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+	0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+	0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+	0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+	0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+	0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+	0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+	0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+	0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+	0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+	0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040,
+};
+
+/*
+ * am2320_crc16() - calculate crc of the sensor's measurements
+ * @raw_data: data frame received from sensor, excluding the crc
+ * @count: size of the data frame
+ * Return: the calculated crc
+ */
+static int am2320_crc16(u8 *raw_data, int count)
+{
+	u16 crc = 0xFFFF;
+
+	while (count--)
+		crc = (crc >> 8) ^ am2320_crc16_table[(crc ^ *raw_data++) & 0xFF];
+
+	return crc;
+}
+#endif
+
 /*
- * am2320_read_values() - read and parse the raw data from the AM2320
- * @data: the struct am2320_data to use for the lock
- * Return: 0 if successful, 1 if not
+ * am2320_xfer() - run a transfer on the adapter, whose bus must be locked
+ * @data: the struct am2320_data of the sensor
+ * @msgs: the messages to transfer
+ * @num: the number of messages
+ * Return: number of messages transferred, negative errno if not
+ */
+static int am2320_xfer(struct am2320_data *data, struct i2c_msg *msgs,
+		       int num)
+{
+	data->sample_xfers++;
+	return __i2c_transfer(data->client->adapter, msgs, num);
+}
+
+/*
+ * am2320_start() - wake the AM2320 and send the measurement command
+ * @data: the struct am2320_data of the sensor
+ * If the adapter supports protocol mangling, the wake-up and the command
+ * are batched into a single transfer with the wake-up allowed to be
+ * NAKed. Otherwise they are sent separately.
+ * The bus is only held for the duration of this phase.
+ * Return: 0 if successful, negative errno if not
  */
-static int am2320_read_values(struct am2320_data *data)
+static int am2320_start(struct am2320_data *data)
 {
-	const u8 cmd_wake[] = { 0x00 };
-	const u8 cmd_meas[] = { AM2320_FUNC_READ, 0x00, AM2320_MEAS_SIZE };
-	int temp, humid, crc;
+	u8 cmd_wake[] = { 0x00 };
+	u8 cmd_meas[] = { AM2320_FUNC_READ, 0x00, AM2320_MEAS_SIZE };
+	struct i2c_client *client = data->client;
+	struct i2c_msg msgs[] = {
+		{
+			.addr = client->addr,
+			.flags = I2C_M_IGNORE_NAK,
+			.len = sizeof(cmd_wake),
+			.buf = cmd_wake,
+		},
+		{
+			.addr = client->addr,
+			.len = sizeof(cmd_meas),
+			.buf = cmd_meas,
+		},
+	};
+	ktime_t start;
 	int res;
-	u8 raw_data[AM2320_FRAME_SIZE];
+
+	i2c_lock_bus(client->adapter, I2C_LOCK_SEGMENT);
+	start = ktime_get();
+
+	if (data->ignore_nak) {
+		res = am2320_xfer(data, msgs, ARRAY_SIZE(msgs));
+		trace_am2320_wake(client, res);
+	} else {
+		/*
+		 * Sensor goes to sleep to reduce self-heating.
+		 * Wake it up by sending a dummy command.
+		 * This may return an error, that's fine.
+		 */
+		msgs[0].flags = 0;
+		res = am2320_xfer(data, &msgs[0], 1);
+		trace_am2320_wake(client, res);
+
+		/* Send the measurement command */
+		res = am2320_xfer(data, &msgs[1], 1);
+	}
+	trace_am2320_command(client, res);
+	if (res < 0)
+		am2320_stat_inc(data, AM2320_STAT_ADAPTER_ERRORS);
+
+	data->bus_held_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	i2c_unlock_bus(client->adapter, I2C_LOCK_SEGMENT);
+
+	return res < 0 ? res : 0;
+}
+
+/*
+ * am2320_is_nak() - check if a transfer failed because it was NAKed
+ * @res: the result of the transfer
+ * Return: true for the errors adapters report a NAK with
+ */
+static bool am2320_is_nak(int res)
+{
+	return res == -ENXIO || res == -EREMOTEIO;
+}
+
+/*
+ * am2320_receive() - read back the measurement frame
+ * @data: the struct am2320_data of the sensor
+ * @raw_data: buffer of AM2320_FRAME_SIZE bytes to store the frame in
+ * @nak_ok: whether a NAK is expected, because the conversion may not have
+ *          finished or the sensor may have gone back to sleep
+ * The bus is only held for the duration of this phase. An expected NAK is
+ * not counted as an error.
+ * Return: 0 if successful, negative errno if not
+ */
+static int am2320_receive(struct am2320_data *data, u8 *raw_data,
+			  bool nak_ok)
+{
 	struct i2c_client *client = data->client;
+	struct i2c_msg msg = {
+		.addr = client->addr,
+		.flags = I2C_M_RD,
+		.len = AM2320_FRAME_SIZE,
+		.buf = raw_data,
+	};
+	ktime_t start;
+	int res;
 
-	/* Check if the poll interval has expired. */
-	mutex_lock(&data->lock);
-	if (!am2320_polltime_expired(data)) {
-		mutex_unlock(&data->lock);
-		return 0;
+	i2c_lock_bus(client->adapter, I2C_LOCK_SEGMENT);
+	start = ktime_get();
+	res = am2320_xfer(data, &msg, 1);
+	data->bus_held_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	i2c_unlock_bus(client->adapter, I2C_LOCK_SEGMENT);
+
+	if (nak_ok && am2320_is_nak(res)) {
+		trace_am2320_not_ready(client, res);
+		return res;
 	}
+	trace_am2320_frame(client, res);
+
+	if (res != 1) {
+		if (res >= 0) {
+			am2320_stat_inc(data, AM2320_STAT_SHORT_READS);
+			return -ENODATA;
+		}
+		am2320_stat_inc(data, AM2320_STAT_ADAPTER_ERRORS);
+		return res;
+	}
+
+	return 0;
+}
+
+/*
+ * am2320_conversion_wait() - wait for a started conversion to finish
+ * @data: the struct am2320_data of the sensor
+ * @elapsed: microseconds already passed since the conversion was started
+ */
+static void am2320_conversion_wait(struct am2320_data *data, s64 elapsed)
+{
+	unsigned int delay = AM2320_MEAS_DELAY;
+	unsigned int slack = AM2320_MEAS_DELAY;
+	ktime_t start;
+
+	if (adaptive_delay) {
+		delay = data->meas_delay + AM2320_MEAS_DELAY_MARGIN;
+		slack = AM2320_MEAS_DELAY_SLACK;
+	}
+
+	if (elapsed >= delay)
+		return;
+
+	start = ktime_get();
+	usleep_range(delay - elapsed, delay - elapsed + slack);
+	trace_am2320_sleep(data->client, delay - elapsed,
+			   ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
+/*
+ * am2320_measure() - wake the AM2320 and read a fresh sample from it
+ * @data: the struct am2320_data of the sensor
+ * @sample: where to store the temperature, humidity and time
+ * The time of the sample is when its conversion was started, which is one
+ * interval ago for a conversion started ahead.
+ * Must be called with data->lock held.
+ * Return: 0 if successful, negative errno if not
+ */
+static int am2320_measure(struct am2320_data *data,
+			  struct am2320_sample *sample)
+{
+	int temp, humid;
+	u16 crc, expected;
+	int res;
+	u8 raw_data[AM2320_FRAME_SIZE];
+	ktime_t idle, retry, time;
+	bool backed_off = false;
+	bool learn;
 
 	/*
-	 * Sensor goes to sleep to reduce self-heating.
-	 * Wake it up by sending a dummy command.
-	 * This may return an error, that's fine.
+	 * If a conversion was started ahead, its result is normally ready by
+	 * now. Otherwise, or if the sensor went back to sleep in the meantime,
+	 * go through the full wake-up and measurement sequence.
 	 */
-	i2c_master_send(client, cmd_wake, sizeof(cmd_wake));
+	res = -EAGAIN;
+	if (data->armed) {
+		data->armed = false;
+		time = data->armed_time;
+		am2320_conversion_wait(data,
+				       ktime_us_delta(ktime_get_boottime(),
+						      time));
+		res = am2320_receive(data, raw_data, true);
+	}
 
-	/* Send the measurement command */
-	res = i2c_master_send(client, cmd_meas, sizeof(cmd_meas));
 	if (res < 0) {
-		mutex_unlock(&data->lock);
-		return res;
-	}
+		res = am2320_start(data);
+		if (res < 0)
+			return res;
+		time = ktime_get_boottime();
 
-	/* Delay at least 1.5ms */
-	usleep_range(AM2320_MEAS_DELAY, AM2320_MEAS_DELAY * 2);
+		/* Delay at least 1.5ms, leaving the bus to other devices */
+		idle = ktime_get();
+		am2320_conversion_wait(data, 0);
+		data->bus_idle_ns += ktime_to_ns(ktime_sub(ktime_get(), idle));
 
-	/* Read back the data */
-	res = i2c_master_recv(client, raw_data, AM2320_FRAME_SIZE);
-	if (res != AM2320_FRAME_SIZE) {
-		mutex_unlock(&data->lock);
-		if (res >= 0)
-			return -ENODATA;
-		return res;
+		/*
+		 * Read back the data. While learning, a NAK means the
+		 * conversion isn't ready yet, any other error is a real one.
+		 */
+		learn = adaptive_delay &&
+			data->meas_delay < AM2320_MEAS_DELAY_MAX;
+		res = am2320_receive(data, raw_data, learn);
+		if (learn && am2320_is_nak(res)) {
+			/* Not ready yet, back off and give it another chance */
+			data->meas_delay = min_t(u32, data->meas_delay +
+						 AM2320_MEAS_DELAY_BACKOFF,
+						 AM2320_MEAS_DELAY_MAX);
+			backed_off = true;
+			retry = ktime_get();
+			am2320_conversion_wait(data, ktime_us_delta(retry,
+								    idle));
+			data->bus_idle_ns += ktime_to_ns(ktime_sub(ktime_get(),
+								   retry));
+			res = am2320_receive(data, raw_data, false);
+		}
+		if (res < 0)
+			return res;
+
+		/* It was ready in time, try a little less next time */
+		if (adaptive_delay && !backed_off)
+			data->meas_delay = max_t(u32, data->meas_delay -
+						 AM2320_MEAS_DELAY_STEP,
+						 AM2320_MEAS_DELAY_MIN);
 	}
 
+	crc = get_unaligned_le16(&raw_data[AM2320_FRAME_SIZE - 2]);
+	expected = am2320_crc16(raw_data, AM2320_FRAME_SIZE - 2);
+	trace_am2320_check(data->client, raw_data, crc, expected);
+
 	/* Check if an error occurred */
 	if (raw_data[0] != AM2320_FUNC_READ ||
 	    raw_data[1] != AM2320_MEAS_SIZE) {
-		mutex_unlock(&data->lock);
+		am2320_stat_inc(data, AM2320_STAT_HEADER_ERRORS);
 		return -EIO;
 	}
 
-	crc = get_unaligned_le16(&raw_data[AM2320_FRAME_SIZE - 2]);
-	if (crc != am2320_crc16(raw_data, AM2320_FRAME_SIZE - 2)) {
-		mutex_unlock(&data->lock);
+	if (crc != expected) {
+		am2320_stat_inc(data, AM2320_STAT_CRC_ERRORS);
 		return -EIO;
 	}
 
@@ -164,33 +908,1017 @@ static int am2320_read_values(struct am2320_data *data)
 	if (temp & 0x8000)
 		temp = -(temp & 0x7FFF);
 
-	data->temperature = temp * 100;
-	data->humidity = humid * 100;
-	data->previous_poll_time = ktime_get_boottime();
+	sample->temperature = temp * 100;
+	sample->humidity = humid * 100;
+	sample->time = time;
+
+	return 0;
+}
+
+/*
+ * am2320_shared_update() - copy the latest record to the shared page
+ * @shared: the shared page
+ * @record: the new record
+ * Must be called with data->lock held, this is the only writer.
+ */
+static void am2320_shared_update(struct am2320_shared *shared,
+				 const struct am2320_record *record)
+{
+	WRITE_ONCE(shared->lock, shared->lock + 1);
+	smp_wmb();
+
+	WRITE_ONCE(shared->seq, record->seq);
+	WRITE_ONCE(shared->temperature, record->temperature);
+	WRITE_ONCE(shared->humidity, record->humidity);
+	WRITE_ONCE(shared->timestamp, record->timestamp);
+	WRITE_ONCE(shared->status, record->status);
+
+	smp_wmb();
+	WRITE_ONCE(shared->lock, shared->lock + 1);
+}
+
+/*
+ * am2320_cdev_publish() - hand a new record to the character device readers
+ * @cdev: the character device of the sensor
+ * @record: the new record
+ * Updates the shared page as well, so must be called with data->lock held.
+ */
+static void am2320_cdev_publish(struct am2320_cdev *cdev,
+				const struct am2320_record *record)
+{
+	am2320_shared_update(cdev->shared, record);
+
+	spin_lock(&cdev->lock);
+	cdev->record = *record;
+	spin_unlock(&cdev->lock);
+
+	wake_up_interruptible(&cdev->sample_wq);
+}
+
+/*
+ * am2320_notify() - wake up pollers of the hwmon attributes that changed
+ * @data: the struct am2320_data of the sensor
+ * Each notification also sends a uevent, so an unchanged value, or one within
+ * the deadband, is not notified.
+ * Must be called with data->lock held.
+ */
+static void am2320_notify(struct am2320_data *data)
+{
+	if (abs(data->temperature - data->notified_temperature) >
+	    temp_deadband) {
+		data->notified_temperature = data->temperature;
+		hwmon_notify_event(data->hwmon_dev, hwmon_temp,
+				   hwmon_temp_input, 0);
+	}
+
+	if (abs(data->humidity - data->notified_humidity) >
+	    humidity_deadband) {
+		data->notified_humidity = data->humidity;
+		hwmon_notify_event(data->hwmon_dev, hwmon_humidity,
+				   hwmon_humidity_input, 0);
+	}
+}
+
+/*
+ * Saturation vapour pressure over water from -80 to 80 degrees in 2 degree
+ * steps, from the Magnus formula 611.2 * exp(17.62 * t / (243.12 + t)) Pa.
+ */
+static const u32 am2320_svp_table[] = {
+	108, 148, 202, 274, 368, 492,
+	653, 860, 1127, 1468, 1901, 2447,
+	3134, 3992, 5060, 6382, 8011, 10010,
+	12452, 15423, 19021, 23364, 28584, 34836,
+	42297, 51169, 61683, 74102, 88723, 105885,
+	125965, 149392, 176645, 208259, 244833, 287031,
+	335593, 391339, 455173, 528093, 611200, 705700,
+	812918, 934300, 1071430, 1226030, 1399976, 1595306,
+	1814226, 2059129, 2332596, 2637415, 2976588, 3353343,
+	3771149, 4233724, 4745050, 5309386, 5931279, 6615581,
+	7367458, 8192406, 9096266, 10085234, 11165880, 12345158,
+	13630424, 15029448, 16550428, 18202007, 19993287, 21933843,
+	24033735, 26303529, 28754305, 31397675, 34245797, 37311389,
+	40607743, 44148737, 47948855,
+};
+
+/*
+ * am2320_svp() - saturation vapour pressure at a temperature
+ * @temp: the temperature in millidegrees
+ * Return: the pressure in millipascal, interpolated from the table
+ */
+static u32 am2320_svp(int temp)
+{
+	const u32 *t = am2320_svp_table;
+	unsigned int i;
+	int frac;
+
+	temp = max(temp, AM2320_SVP_TEMP_MIN);
+	i = min_t(unsigned int,
+		  (temp - AM2320_SVP_TEMP_MIN) / AM2320_SVP_TEMP_STEP,
+		  ARRAY_SIZE(am2320_svp_table) - 2);
+	frac = min(temp - AM2320_SVP_TEMP_MIN - (int)i * AM2320_SVP_TEMP_STEP,
+		   AM2320_SVP_TEMP_STEP);
+
+	return t[i] + div_u64((u64)(t[i + 1] - t[i]) * frac,
+			      AM2320_SVP_TEMP_STEP);
+}
+
+/*
+ * am2320_vapour_pressure() - partial pressure of the water vapour
+ * @temp: the temperature in millidegrees
+ * @humidity: the relative humidity in millipercent
+ * Return: the pressure in millipascal
+ */
+static u32 am2320_vapour_pressure(int temp, int humidity)
+{
+	return div_u64((u64)am2320_svp(temp) * humidity, 100000);
+}
+
+/*
+ * am2320_dew_point() - temperature at which the vapour would saturate
+ * @temp: the temperature in millidegrees
+ * @humidity: the relative humidity in millipercent
+ * Return: the dew point in millidegrees, clamped to the table's range
+ */
+static int am2320_dew_point(int temp, int humidity)
+{
+	const u32 *t = am2320_svp_table;
+	u32 e = am2320_vapour_pressure(temp, humidity);
+	int lo = 0, hi = ARRAY_SIZE(am2320_svp_table) - 1;
+
+	if (e <= t[lo])
+		return AM2320_SVP_TEMP_MIN;
+	if (e >= t[hi])
+		return AM2320_SVP_TEMP_MIN + hi * AM2320_SVP_TEMP_STEP;
+
+	while (hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+
+		if (t[mid] <= e)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return AM2320_SVP_TEMP_MIN + lo * AM2320_SVP_TEMP_STEP +
+	       (int)div_u64((u64)(e - t[lo]) * AM2320_SVP_TEMP_STEP,
+			    t[hi] - t[lo]);
+}
+
+/*
+ * am2320_absolute_humidity() - mass of water vapour per volume of air
+ * @temp: the temperature in millidegrees
+ * @humidity: the relative humidity in millipercent
+ * Return: the absolute humidity in mg/m^3
+ */
+static int am2320_absolute_humidity(int temp, int humidity)
+{
+	u32 e = am2320_vapour_pressure(temp, humidity);
+
+	/* e / (Rv * T) with Rv = 461.5 J/(kg K), T in millikelvin */
+	return div_u64((u64)e * 2000000, 923 * (u32)(temp + 273150));
+}
+
+static int am2320_cmp_int(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * am2320_filter_apply() - run a new raw value through the channel's filter
+ * @data: the struct am2320_data of the sensor
+ * @channel: the enum am2320_channel of the value
+ * @value: the raw value
+ * Must be called with data->lock held.
+ * Return: the filtered value
+ */
+static int am2320_filter_apply(struct am2320_data *data, int channel,
+			       int value)
+{
+	struct am2320_filter *f = &data->filter[channel];
+	unsigned int n = data->samples;
+	int sorted[AM2320_FILTER_MAX_SAMPLES];
+	s64 sum = 0;
+
+	if (filter == AM2320_FILTER_NONE || n <= 1)
+		return value;
+
+	if (filter == AM2320_FILTER_EMA) {
+		/* alpha = 2 / (n + 1), seeded with the first value */
+		if (!f->fill) {
+			f->ema = (s64)value << AM2320_FILTER_EMA_SHIFT;
+			f->fill = 1;
+		} else {
+			f->ema += div_s64(((s64)value << AM2320_FILTER_EMA_SHIFT) -
+					  f->ema, n + 1) * 2;
+		}
+		return f->ema >> AM2320_FILTER_EMA_SHIFT;
+	}
+
+	f->window[f->next] = value;
+	f->next = (f->next + 1) % n;
+	if (f->fill < n)
+		f->fill++;
+
+	if (filter == AM2320_FILTER_MEDIAN) {
+		memcpy(sorted, f->window, f->fill * sizeof(*sorted));
+		sort(sorted, f->fill, sizeof(*sorted), am2320_cmp_int, NULL);
+		if (f->fill & 1)
+			return sorted[f->fill / 2];
+		return (sorted[f->fill / 2 - 1] + sorted[f->fill / 2]) / 2;
+	}
+
+	for (unsigned int i = 0; i < f->fill; i++)
+		sum += f->window[i];
+	return div_s64(sum, f->fill);
+}
+
+/*
+ * am2320_history_add() - account a new value in the running statistics
+ * @history: the statistics of the channel
+ * @value: the new value
+ * Must be called inside the write side of data->seq.
+ */
+static void am2320_history_add(struct am2320_history *history, int value)
+{
+	if (!history->count || value < history->lowest)
+		history->lowest = value;
+	if (!history->count || value > history->highest)
+		history->highest = value;
+	history->sum += value;
+	history->count++;
+}
+
+/*
+ * am2320_history_reset() - restart the running statistics of a channel
+ * @data: the struct am2320_data of the sensor
+ * @channel: the enum am2320_channel to reset
+ * The statistics restart from the current value.
+ */
+static void am2320_history_reset(struct am2320_data *data, int channel)
+{
+	struct am2320_history *history = &data->history[channel];
+
+	mutex_lock(&data->lock);
+	write_seqcount_begin(&data->seq);
+	history->count = 0;
+	history->sum = 0;
+	if (data->previous_poll_time)
+		am2320_history_add(history, channel == AM2320_CHAN_TEMP ?
+				   data->temperature : data->humidity);
+	write_seqcount_end(&data->seq);
+	mutex_unlock(&data->lock);
+}
+
+/*
+ * am2320_history_read() - read a running statistic without taking the lock
+ * @data: the struct am2320_data of the sensor
+ * @channel: the enum am2320_channel to read
+ * @kind: the enum am2320_history_kind to read
+ * @val: where to store the statistic
+ * Return: 0 if successful, -ENODATA before the first sample
+ */
+static int am2320_history_read(struct am2320_data *data, int channel,
+			       int kind, long *val)
+{
+	struct am2320_history history;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&data->seq);
+		history = data->history[channel];
+	} while (read_seqcount_retry(&data->seq, seq));
+
+	if (!history.count)
+		return -ENODATA;
+
+	switch (kind) {
+	case AM2320_HIST_LOWEST:
+		*val = history.lowest;
+		break;
+	case AM2320_HIST_HIGHEST:
+		*val = history.highest;
+		break;
+	default:
+		*val = div_s64(history.sum, history.count);
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * am2320_check_alarms() - evaluate the thresholds against the new sample
+ * @data: the struct am2320_data of the sensor
+ * An alarm is raised when the value crosses its threshold and only cleared
+ * once it is back past the threshold's hysteresis.
+ * Must be called with data->lock held.
+ */
+static void am2320_check_alarms(struct am2320_data *data)
+{
+	for (int i = 0; i < AM2320_NUM_LIMITS; i++) {
+		const struct am2320_limit_info *info = &am2320_limits[i];
+		int limit = READ_ONCE(data->limits[i]);
+		int hyst = READ_ONCE(data->hyst[i]);
+		bool active = test_bit(i, &data->alarms);
+		bool raise, clear;
+		int value;
+
+		if (info->type == hwmon_temp)
+			value = data->temperature;
+		else
+			value = data->humidity;
+
+		if (info->low) {
+			raise = value < limit;
+			clear = value >= limit + hyst;
+		} else {
+			raise = value > limit;
+			clear = value <= limit - hyst;
+		}
+
+		if (active ? !clear : !raise)
+			continue;
+
+		change_bit(i, &data->alarms);
+		hwmon_notify_event(data->hwmon_dev, info->type, info->alarm, 0);
+	}
+}
+
+/*
+ * am2320_netlink_send() - multicast the latest sample to netlink subscribers
+ * @data: the struct am2320_data of the sensor
+ * Must be called with data->lock held.
+ */
+static void am2320_netlink_send(struct am2320_data *data)
+{
+	struct i2c_client *client = data->client;
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!netlink || !genl_has_listeners(&am2320_genl_family, &init_net,
+					    AM2320_MCGRP_SAMPLES))
+		return;
+
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!skb)
+		return;
+
+	hdr = genlmsg_put(skb, 0, 0, &am2320_genl_family, 0, AM2320_CMD_SAMPLE);
+	if (!hdr)
+		goto err_free;
+
+	if (nla_put_string(skb, AM2320_ATTR_DEVICE, dev_name(&client->dev)) ||
+	    nla_put_u32(skb, AM2320_ATTR_ADAPTER,
+			i2c_adapter_id(client->adapter)) ||
+	    nla_put_u16(skb, AM2320_ATTR_ADDR, client->addr) ||
+	    nla_put_s32(skb, AM2320_ATTR_TEMPERATURE, data->temperature) ||
+	    nla_put_s32(skb, AM2320_ATTR_HUMIDITY, data->humidity) ||
+	    nla_put_u64_64bit(skb, AM2320_ATTR_TIMESTAMP,
+			      ktime_to_ns(data->previous_poll_time),
+			      AM2320_ATTR_PAD) ||
+	    nla_put_s32(skb, AM2320_ATTR_STATUS, data->status) ||
+	    nla_put_u32(skb, AM2320_ATTR_SEQ, data->sample_seq))
+		goto err_free;
+
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&am2320_genl_family, skb, 0, AM2320_MCGRP_SAMPLES,
+			  GFP_KERNEL);
+	return;
+
+err_free:
+	nlmsg_free(skb);
+}
+
+/*
+ * am2320_update() - take a new sample and publish it
+ * @data: the struct am2320_data of the sensor
+ * Must be called with data->lock held.
+ * Return: 0 if successful, negative errno if not
+ */
+static int am2320_update(struct am2320_data *data)
+{
+	struct am2320_sample sample;
+	struct am2320_record record;
+	ktime_t start = ktime_get();
+	ktime_t deadline;
+	int res;
+
+	data->sample_xfers = 0;
+	data->bus_held_ns = 0;
+	data->bus_idle_ns = 0;
+
+	/*
+	 * A corrupted frame is usually a glitch on the wires, measure again
+	 * rather than failing the whole refresh.
+	 */
+	deadline = ktime_add_ms(start, retry_budget_ms);
+	for (unsigned int attempt = 0; ; attempt++) {
+		res = am2320_measure(data, &sample);
+		if (res != -EIO || attempt >= max_retries ||
+		    ktime_after(ktime_get(), deadline))
+			break;
+		am2320_stat_inc(data, AM2320_STAT_RETRIES);
+	}
+
+	if (!res) {
+		sample.temperature = am2320_filter_apply(data, AM2320_CHAN_TEMP,
+							 sample.temperature);
+		sample.humidity = am2320_filter_apply(data,
+						      AM2320_CHAN_HUMIDITY,
+						      sample.humidity);
+	}
+
+	write_seqcount_begin(&data->seq);
+	if (!res) {
+		data->temperature = sample.temperature;
+		data->humidity = sample.humidity;
+		data->previous_poll_time = sample.time;
+		data->dew_point = am2320_dew_point(sample.temperature,
+						   sample.humidity);
+		data->absolute_humidity =
+			am2320_absolute_humidity(sample.temperature,
+						 sample.humidity);
+		am2320_history_add(&data->history[AM2320_CHAN_TEMP],
+				   sample.temperature);
+		am2320_history_add(&data->history[AM2320_CHAN_HUMIDITY],
+				   sample.humidity);
+	}
+	if (res) {
+		/* Back off exponentially, other devices share the bus */
+		data->failures++;
+		data->backoff_ms = min_t(u32, AM2320_BACKOFF_MIN <<
+					 min(data->failures - 1, 10U),
+					 AM2320_BACKOFF_MAX);
+		data->backoff_until = ktime_add_ms(ktime_get_boottime(),
+						   data->backoff_ms);
+	} else {
+		data->failures = 0;
+		data->backoff_ms = 0;
+	}
+	data->status = res;
+	data->sample_seq++;
+	write_seqcount_end(&data->seq);
+
+	trace_am2320_publish(data->client, res, data->temperature,
+			     data->humidity, data->sample_seq);
+	am2320_latency_add(data->stats.refresh_latency, start);
+	am2320_stat_inc(data, AM2320_STAT_REFRESHES);
+	if (res)
+		am2320_stat_inc(data, AM2320_STAT_FAILURES);
+
+	am2320_netlink_send(data);
+
+	record = (struct am2320_record) {
+		.temperature = data->temperature,
+		.humidity = data->humidity,
+		.timestamp = ktime_to_ns(data->previous_poll_time),
+		.status = data->status,
+		.seq = data->sample_seq,
+	};
+	am2320_cdev_publish(data->cdev, &record);
+
+	if (!res) {
+		am2320_check_alarms(data);
+		am2320_notify(data);
+	}
+
+	/* Start the conversion for the next refresh right away */
+	if (!res && measure_ahead && !am2320_start(data)) {
+		data->armed = true;
+		data->armed_time = ktime_get_boottime();
+	}
+
+	return res;
+}
+
+/*
+ * am2320_lock() - take the lock to refresh the sample
+ * @data: the struct am2320_data of the sensor
+ */
+static void am2320_lock(struct am2320_data *data)
+{
+	ktime_t start = ktime_get();
+
+	mutex_lock(&data->lock);
+	trace_am2320_lock(data->client,
+			  ktime_to_ns(ktime_sub(ktime_get(), start)));
+	am2320_latency_add(data->stats.lock_wait, start);
+}
+
+/*
+ * am2320_refresh() - take a new sample if the poll interval has expired
+ * @data: the struct am2320_data to use for the lock
+ * @sample: where to store the resulting sample
+ * Only the refresh itself serializes on the lock, a cached sample is
+ * returned straight from the seqcount. Only one reader refreshes at a
+ * time, everybody arriving meanwhile waits for and shares its result.
+ * Return: 0 if successful, negative errno if not
+ */
+static int am2320_refresh(struct am2320_data *data,
+			  struct am2320_sample *sample)
+{
+	int res = 0;
+
+	am2320_sample_get(data, sample);
+	if (!am2320_polltime_expired(data, sample)) {
+		am2320_stat_inc(data, AM2320_STAT_CACHE_HITS);
+		return 0;
+	}
+
+	/* Don't hammer a failing sensor, return the last error instead */
+	if (am2320_backing_off(sample)) {
+		am2320_stat_inc(data, AM2320_STAT_BACKOFF_HITS);
+		return sample->status;
+	}
+
+	spin_lock(&data->flight_lock);
+	if (data->in_flight) {
+		u32 gen = data->flight_gen;
+
+		am2320_stat_inc(data, AM2320_STAT_COALESCED_READS);
+		spin_unlock(&data->flight_lock);
+
+		/* Wait for the flight we joined, not for a later one */
+		wait_event(data->flight_wq, READ_ONCE(data->flight_gen) != gen);
+
+		spin_lock(&data->flight_lock);
+		res = data->flight_res;
+		spin_unlock(&data->flight_lock);
+
+		am2320_sample_get(data, sample);
+		return res;
+	}
+	data->in_flight = true;
+	spin_unlock(&data->flight_lock);
+
+	am2320_lock(data);
+	/* The background worker may have refreshed while we waited */
+	am2320_sample_get(data, sample);
+	if (am2320_backing_off(sample)) {
+		res = sample->status;
+	} else if (am2320_polltime_expired(data, sample)) {
+		res = am2320_update(data);
+		am2320_sample_get(data, sample);
+	}
+	mutex_unlock(&data->lock);
+
+	spin_lock(&data->flight_lock);
+	data->flight_res = res;
+	data->flight_gen++;
+	data->in_flight = false;
+	spin_unlock(&data->flight_lock);
+	wake_up_all(&data->flight_wq);
+
+	return res;
+}
+
+/*
+ * am2320_read_values() - get an up to date sample
+ * @data: the struct am2320_data to use for the lock
+ * @sample: where to store the sample
+ * In background mode the worker keeps the sample fresh and this never
+ * touches the bus. If the refresh failed but the last good sample is
+ * younger than stale_grace_ms, that sample is returned instead. A refresh
+ * is only due once the sample is update_interval old, so a grace of up to
+ * that has no effect.
+ * Return: 0 if successful, negative errno if not
+ */
+static int am2320_read_values(struct am2320_data *data,
+			      struct am2320_sample *sample)
+{
+	int res;
+
+	am2320_sample_get(data, sample);
+
+	/* The worker is still trying to take the first sample */
+	if (!sample->time)
+		return -ENODATA;
+
+	if (background) {
+		am2320_stat_inc(data, AM2320_STAT_CACHE_HITS);
+		res = sample->status;
+	} else {
+		res = am2320_refresh(data, sample);
+	}
+
+	/* Paper over transient errors while the last good sample is recent */
+	if (res < 0 && am2320_sample_age(sample) <= stale_grace_ms)
+		return 0;
+
+	return res;
+}
+
+/*
+ * am2320_schedule_work() - run the worker after one poll interval
+ * If the sensor is failing, wait for the backoff instead if that is longer.
+ */
+static void am2320_schedule_work(struct am2320_data *data)
+{
+	unsigned int delay = max_t(unsigned int,
+				   ktime_to_ms(data->min_poll_interval),
+				   READ_ONCE(data->backoff_ms));
+
+	queue_delayed_work(system_freezable_wq, &data->work,
+			   msecs_to_jiffies(delay));
+}
+
+/*
+ * am2320_work() - refresh the sample once per poll interval
+ * Takes the first sample after probe, retrying with the backoff until it
+ * succeeds. After that it runs in background mode and while the character
+ * device is open.
+ */
+static void am2320_work(struct work_struct *work)
+{
+	struct am2320_data *data = container_of(to_delayed_work(work),
+						struct am2320_data, work);
+	bool first;
+	int res;
+
+	am2320_lock(data);
+	res = am2320_update(data);
+	first = !data->previous_poll_time;
+	mutex_unlock(&data->lock);
+	if (res < 0)
+		dev_dbg(&data->client->dev, "background refresh failed: %d\n",
+			res);
+
+	if (first) {
+		queue_delayed_work(system_freezable_wq, &data->work,
+				   msecs_to_jiffies(READ_ONCE(data->backoff_ms)));
+		return;
+	}
+
+	if (background || atomic_read(&data->cdev->users))
+		am2320_schedule_work(data);
+}
+
+static void am2320_cancel_work(void *arg)
+{
+	struct am2320_data *data = arg;
+
+	cancel_delayed_work_sync(&data->work);
+}
+
+/**
+ *   struct am2320_reader - State of an open character device file
+ *   @cdev: The character device the file was opened for
+ *   @seq: The sequence number of the last record read
+ */
+struct am2320_reader {
+	struct am2320_cdev *cdev;
+	u32 seq;
+};
+
+static void am2320_cdev_free(struct kref *kref)
+{
+	struct am2320_cdev *cdev = container_of(kref, struct am2320_cdev, kref);
+
+	/* Mappings hold their own reference, the page lives until unmapped */
+	free_page((unsigned long)cdev->shared);
+	kfree(cdev);
+}
+
+static void am2320_cdev_put(struct am2320_cdev *cdev)
+{
+	kref_put(&cdev->kref, am2320_cdev_free);
+}
+
+/*
+ * am2320_cdev_seq() - sequence number of the latest record
+ */
+static u32 am2320_cdev_seq(struct am2320_cdev *cdev)
+{
+	u32 seq;
+
+	spin_lock(&cdev->lock);
+	seq = cdev->record.seq;
+	spin_unlock(&cdev->lock);
+
+	return seq;
+}
+
+/*
+ * am2320_cdev_next() - get the next record for a reader
+ * @reader: the state of the open file
+ * @record: where to store the record
+ * @nonblock: fail with -EAGAIN rather than waiting for a new record
+ * The first call returns the current record, every following one waits
+ * until a new one has been published.
+ * Return: 0 if successful, -ENODEV once the sensor is gone, negative errno
+ *         if interrupted
+ */
+static int am2320_cdev_next(struct am2320_reader *reader,
+			    struct am2320_record *record, bool nonblock)
+{
+	struct am2320_cdev *cdev = reader->cdev;
+	int res;
+
+	for (;;) {
+		if (READ_ONCE(cdev->gone))
+			return -ENODEV;
+
+		spin_lock(&cdev->lock);
+		*record = cdev->record;
+		spin_unlock(&cdev->lock);
+		if (record->seq != reader->seq)
+			break;
+
+		if (nonblock)
+			return -EAGAIN;
+
+		res = wait_event_interruptible(cdev->sample_wq,
+				am2320_cdev_seq(cdev) != reader->seq ||
+				READ_ONCE(cdev->gone));
+		if (res)
+			return res;
+	}
+
+	reader->seq = record->seq;
+
+	return 0;
+}
+
+/*
+ * am2320_cdev_poll_mask() - readiness of an open file
+ */
+static __poll_t am2320_cdev_poll_mask(struct am2320_reader *reader)
+{
+	struct am2320_cdev *cdev = reader->cdev;
+
+	if (READ_ONCE(cdev->gone))
+		return EPOLLHUP | EPOLLERR;
+
+	if (am2320_cdev_seq(cdev) != reader->seq)
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static int am2320_cdev_open(struct inode *inode, struct file *file)
+{
+	struct am2320_cdev *cdev = container_of(file->private_data,
+						struct am2320_cdev, miscdev);
+	struct am2320_reader *reader;
+
+	/* The misc core serializes this against misc_deregister() */
+	if (READ_ONCE(cdev->gone))
+		return -ENODEV;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	kref_get(&cdev->kref);
+	reader->cdev = cdev;
+	file->private_data = reader;
+
+	/* Keep new samples coming while somebody is waiting for them */
+	if (atomic_inc_return(&cdev->users) == 1 && !background)
+		am2320_schedule_work(cdev->data);
+
+	return stream_open(inode, file);
+}
+
+static int am2320_cdev_release(struct inode *inode, struct file *file)
+{
+	struct am2320_reader *reader = file->private_data;
+	struct am2320_cdev *cdev = reader->cdev;
+
+	atomic_dec(&cdev->users);
+	kfree(reader);
+	am2320_cdev_put(cdev);
+
+	return 0;
+}
+
+/*
+ * am2320_cdev_read() - read one binary record
+ * The first read returns the current sample, every following read blocks
+ * until a new one has been taken.
+ */
+static ssize_t am2320_cdev_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct am2320_reader *reader = file->private_data;
+	struct am2320_record record;
+	u32 seq = reader->seq;
+	int res;
+
+	if (count < sizeof(record))
+		return -EINVAL;
+
+	res = am2320_cdev_next(reader, &record, file->f_flags & O_NONBLOCK);
+	if (res)
+		return res;
+
+	if (copy_to_user(buf, &record, sizeof(record))) {
+		reader->seq = seq;
+		return -EFAULT;
+	}
+
+	return sizeof(record);
+}
+
+static __poll_t am2320_cdev_poll(struct file *file, poll_table *wait)
+{
+	struct am2320_reader *reader = file->private_data;
+
+	poll_wait(file, &reader->cdev->sample_wq, wait);
+
+	return am2320_cdev_poll_mask(reader);
+}
+
+/*
+ * am2320_cdev_mmap() - map the shared sample page read-only
+ */
+static int am2320_cdev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct am2320_reader *reader = file->private_data;
+	struct am2320_cdev *cdev = reader->cdev;
+
+	if (READ_ONCE(cdev->gone))
+		return -ENODEV;
+
+	if (vma->vm_pgoff || vma_pages(vma) != 1)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return vm_insert_page(vma, vma->vm_start,
+			      virt_to_page(cdev->shared));
+}
+
+static const struct file_operations am2320_cdev_fops = {
+	.owner = THIS_MODULE,
+	.open = am2320_cdev_open,
+	.release = am2320_cdev_release,
+	.read = am2320_cdev_read,
+	.poll = am2320_cdev_poll,
+	.mmap = am2320_cdev_mmap,
+};
+
+/*
+ * am2320_cdev_create() - allocate the character device state
+ * Return: the state holding one reference, NULL if out of memory
+ */
+static struct am2320_cdev *am2320_cdev_create(void)
+{
+	struct am2320_cdev *cdev;
+
+	cdev = kzalloc(sizeof(*cdev), GFP_KERNEL);
+	if (!cdev)
+		return NULL;
+
+	cdev->shared = (struct am2320_shared *)get_zeroed_page(GFP_KERNEL);
+	if (!cdev->shared) {
+		kfree(cdev);
+		return NULL;
+	}
+
+	kref_init(&cdev->kref);
+	spin_lock_init(&cdev->lock);
+	init_waitqueue_head(&cdev->sample_wq);
+
+	return cdev;
+}
+
+/*
+ * am2320_cdev_unplug() - fail all open files, the sensor is going away
+ */
+static void am2320_cdev_unplug(struct am2320_cdev *cdev)
+{
+	WRITE_ONCE(cdev->gone, true);
+	wake_up_interruptible(&cdev->sample_wq);
+}
+
+static void am2320_cdev_drop(void *arg)
+{
+	am2320_cdev_put(arg);
+}
+
+/*
+ * am2320_cdev_alloc() - allocate the character device state of a sensor
+ * This happens before the worker can publish a record, the device itself is
+ * only registered by am2320_cdev_init(). The sensor holds a reference until
+ * it is unbound, open files hold their own.
+ */
+static int am2320_cdev_alloc(struct am2320_data *data)
+{
+	struct am2320_cdev *cdev;
+
+	cdev = am2320_cdev_create();
+	if (!cdev)
+		return -ENOMEM;
+
+	cdev->data = data;
+	data->cdev = cdev;
+
+	return devm_add_action_or_reset(&data->client->dev, am2320_cdev_drop,
+					cdev);
+}
+
+static void am2320_cdev_remove(void *arg)
+{
+	struct am2320_cdev *cdev = arg;
+
+	misc_deregister(&cdev->miscdev);
+	am2320_cdev_unplug(cdev);
+}
+
+/*
+ * am2320_cdev_init() - register the /dev/am2320-<bus>-<addr> character device
+ */
+static int am2320_cdev_init(struct am2320_data *data)
+{
+	struct am2320_cdev *cdev = data->cdev;
+	struct i2c_client *client = data->client;
+	struct device *device = &client->dev;
+	int res;
+
+	cdev->miscdev.minor = MISC_DYNAMIC_MINOR;
+	cdev->miscdev.name = devm_kasprintf(device, GFP_KERNEL,
+					    "am2320-%d-%04x",
+					    i2c_adapter_id(client->adapter),
+					    client->addr);
+	if (!cdev->miscdev.name)
+		return -ENOMEM;
+	cdev->miscdev.fops = &am2320_cdev_fops;
+	cdev->miscdev.parent = device;
+	cdev->miscdev.mode = 0444;
+
+	res = misc_register(&cdev->miscdev);
+	if (res)
+		return res;
+
+	return devm_add_action_or_reset(device, am2320_cdev_remove, cdev);
+}
+
+/*
+ * am2320_interval_write() - store the given minimum poll interval.
+ * Return: 0 on success, -EINVAL if a value lower than the
+ *         AM2320_MIN_POLL_INTERVAL is given
+ */
+static ssize_t am2320_interval_write(struct am2320_data *data, long val)
+{
+	if (val < AM2320_MIN_POLL_INTERVAL)
+		return -EINVAL;
+	data->min_poll_interval = ms_to_ktime(val);
+	return 0;
+}
+
+/*
+ * am2320_interval_read() - read the minimum poll interval in milliseconds
+ */
+static ssize_t am2320_interval_read(struct am2320_data *data, long *val)
+{
+	*val = ktime_to_ms(data->min_poll_interval);
+	return 0;
+}
+
+/*
+ * am2320_dew_point_read() - read the dew point in millidegrees
+ */
+static int am2320_dew_point_read(struct am2320_data *data, long *val)
+{
+	struct am2320_sample sample;
+	int res;
+
+	res = am2320_read_values(data, &sample);
+	if (res < 0)
+		return res;
 
-	mutex_unlock(&data->lock);
+	*val = sample.dew_point;
 	return 0;
 }
 
 /*
- * am2320_interval_write() - store the given minimum poll interval.
- * Return: 0 on success, -EINVAL if a value lower than the
- *         AM2320_MIN_POLL_INTERVAL is given
+ * am2320_samples_write() - set the filter window and restart the filters
+ * Return: 0 on success, -EINVAL if the window is out of range
  */
-static ssize_t am2320_interval_write(struct am2320_data *data, long val)
+static int am2320_samples_write(struct am2320_data *data, long val)
 {
-	if (val < AM2320_MIN_POLL_INTERVAL)
+	if (val < 1 || val > AM2320_FILTER_MAX_SAMPLES)
 		return -EINVAL;
-	data->min_poll_interval = ms_to_ktime(val);
+
+	mutex_lock(&data->lock);
+	data->samples = val;
+	memset(data->filter, 0, sizeof(data->filter));
+	mutex_unlock(&data->lock);
+
 	return 0;
 }
 
 /*
- * am2320_interval_read() - read the minimum poll interval in milliseconds
+ * am2320_samples_read() - read the filter window
  */
-static ssize_t am2320_interval_read(struct am2320_data *data, long *val)
+static int am2320_samples_read(struct am2320_data *data, long *val)
 {
-	*val = ktime_to_ms(data->min_poll_interval);
+	*val = READ_ONCE(data->samples);
 	return 0;
 }
 
@@ -199,13 +1927,14 @@ static ssize_t am2320_interval_read(struct am2320_data *data, long *val)
  */
 static int am2320_temperature1_read(struct am2320_data *data, long *val)
 {
+	struct am2320_sample sample;
 	int res;
 
-	res = am2320_read_values(data);
+	res = am2320_read_values(data, &sample);
 	if (res < 0)
 		return res;
 
-	*val = data->temperature;
+	*val = sample.temperature;
 	return 0;
 }
 
@@ -214,13 +1943,130 @@ static int am2320_temperature1_read(struct am2320_data *data, long *val)
  */
 static int am2320_humidity1_read(struct am2320_data *data, long *val)
 {
+	struct am2320_sample sample;
 	int res;
 
-	res = am2320_read_values(data);
+	res = am2320_read_values(data, &sample);
 	if (res < 0)
 		return res;
 
-	*val = data->humidity;
+	*val = sample.humidity;
+	return 0;
+}
+
+/*
+ * am2320_limit_find() - look up the threshold, hysteresis or alarm of an
+ *                       attribute
+ * @type: the hwmon sensor type
+ * @attr: the hwmon attribute
+ * @kind: set to the enum am2320_limit_attr @attr is
+ * Return: the enum am2320_limit, -EOPNOTSUPP if there is none
+ */
+static int am2320_limit_find(enum hwmon_sensor_types type, u32 attr,
+			     int *kind)
+{
+	for (int i = 0; i < AM2320_NUM_LIMITS; i++) {
+		if (am2320_limits[i].type != type)
+			continue;
+		if (am2320_limits[i].attr == attr) {
+			*kind = AM2320_LIMIT_VALUE;
+			return i;
+		}
+		if (am2320_limits[i].hyst == attr) {
+			*kind = AM2320_LIMIT_HYST;
+			return i;
+		}
+		if (am2320_limits[i].alarm == attr) {
+			*kind = AM2320_LIMIT_ALARM;
+			return i;
+		}
+	}
+
+	return -EOPNOTSUPP;
+}
+
+/*
+ * am2320_hyst_read() - the hysteresis of a threshold as an absolute value
+ * @data: the struct am2320_data of the sensor
+ * @i: the enum am2320_limit
+ * Return: the value an alarm of the threshold clears at
+ */
+static int am2320_hyst_read(struct am2320_data *data, int i)
+{
+	int limit = READ_ONCE(data->limits[i]);
+	int hyst = READ_ONCE(data->hyst[i]);
+
+	return am2320_limits[i].low ? limit + hyst : limit - hyst;
+}
+
+/*
+ * am2320_limit_clamp() - clamp a value to the sensor range of its type
+ */
+static long am2320_limit_clamp(enum hwmon_sensor_types type, long val)
+{
+	if (type == hwmon_temp)
+		return clamp_val(val, AM2320_TEMP_MIN, AM2320_TEMP_MAX);
+
+	return clamp_val(val, AM2320_HUMIDITY_MIN, AM2320_HUMIDITY_MAX);
+}
+
+/*
+ * am2320_limit_read() - read a threshold, its hysteresis or its alarm
+ */
+static int am2320_limit_read(struct am2320_data *data,
+			     enum hwmon_sensor_types type, u32 attr, long *val)
+{
+	int kind;
+	int i;
+
+	i = am2320_limit_find(type, attr, &kind);
+	if (i < 0)
+		return i;
+
+	switch (kind) {
+	case AM2320_LIMIT_ALARM:
+		*val = test_bit(i, &data->alarms);
+		break;
+	case AM2320_LIMIT_HYST:
+		*val = am2320_hyst_read(data, i);
+		break;
+	default:
+		*val = READ_ONCE(data->limits[i]);
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * am2320_limit_write() - store a threshold or its hysteresis, clamped to the
+ *                        sensor range
+ * The hysteresis is written as the absolute value the alarm clears at, and
+ * is kept relative to the threshold, so it moves along when that changes. A
+ * hysteresis on the wrong side of the threshold is taken as none. The new
+ * values are evaluated with the next sample.
+ */
+static int am2320_limit_write(struct am2320_data *data,
+			      enum hwmon_sensor_types type, u32 attr, long val)
+{
+	int kind;
+	int limit;
+	int i;
+
+	i = am2320_limit_find(type, attr, &kind);
+	if (i < 0 || kind == AM2320_LIMIT_ALARM)
+		return -EOPNOTSUPP;
+
+	val = am2320_limit_clamp(type, val);
+
+	if (kind == AM2320_LIMIT_VALUE) {
+		WRITE_ONCE(data->limits[i], val);
+		return 0;
+	}
+
+	limit = READ_ONCE(data->limits[i]);
+	val = am2320_limits[i].low ? val - limit : limit - val;
+	WRITE_ONCE(data->hyst[i], max_t(long, val, 0));
 	return 0;
 }
 
@@ -228,11 +2074,20 @@ static umode_t am2320_hwmon_visible(const void *data,
 				    enum hwmon_sensor_types type, u32 attr,
 				    int channel)
 {
+	int kind;
+
 	switch (type) {
 	case hwmon_temp:
 	case hwmon_humidity:
+		if (type == hwmon_temp && attr == hwmon_temp_reset_history)
+			return 0200;
+		if (am2320_limit_find(type, attr, &kind) >= 0 &&
+		    kind != AM2320_LIMIT_ALARM)
+			return 0644;
 		return 0444;
 	case hwmon_chip:
+		if (attr == hwmon_chip_reset_history)
+			return 0200;
 		return 0644;
 	default:
 		return 0;
@@ -246,39 +2101,509 @@ static int am2320_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
 
 	switch (type) {
 	case hwmon_temp:
-		return am2320_temperature1_read(data, val);
+		if (channel == 1)
+			return am2320_dew_point_read(data, val);
+
+		switch (attr) {
+		case hwmon_temp_input:
+			return am2320_temperature1_read(data, val);
+		case hwmon_temp_lowest:
+			return am2320_history_read(data, AM2320_CHAN_TEMP,
+						   AM2320_HIST_LOWEST, val);
+		case hwmon_temp_highest:
+			return am2320_history_read(data, AM2320_CHAN_TEMP,
+						   AM2320_HIST_HIGHEST, val);
+		default:
+			return am2320_limit_read(data, type, attr, val);
+		}
 	case hwmon_humidity:
-		return am2320_humidity1_read(data, val);
+		if (attr == hwmon_humidity_input)
+			return am2320_humidity1_read(data, val);
+		return am2320_limit_read(data, type, attr, val);
 	case hwmon_chip:
+		if (attr == hwmon_chip_samples)
+			return am2320_samples_read(data, val);
 		return am2320_interval_read(data, val);
 	default:
 		return -EOPNOTSUPP;
 	}
 }
 
+static int am2320_hwmon_read_string(struct device *dev,
+				    enum hwmon_sensor_types type, u32 attr,
+				    int channel, const char **str)
+{
+	if (type == hwmon_temp && attr == hwmon_temp_label && channel == 1) {
+		*str = "dew point";
+		return 0;
+	}
+
+	return -EOPNOTSUPP;
+}
+
 static int am2320_hwmon_write(struct device *dev, enum hwmon_sensor_types type,
 			      u32 attr, int channel, long val)
 {
 	struct am2320_data *data = dev_get_drvdata(dev);
 
 	switch (type) {
+	case hwmon_temp:
+		if (attr == hwmon_temp_reset_history) {
+			am2320_history_reset(data, AM2320_CHAN_TEMP);
+			return 0;
+		}
+		return am2320_limit_write(data, type, attr, val);
+	case hwmon_humidity:
+		return am2320_limit_write(data, type, attr, val);
 	case hwmon_chip:
+		if (attr == hwmon_chip_reset_history) {
+			am2320_history_reset(data, AM2320_CHAN_TEMP);
+			am2320_history_reset(data, AM2320_CHAN_HUMIDITY);
+			return 0;
+		}
+		if (attr == hwmon_chip_samples)
+			return am2320_samples_write(data, val);
 		return am2320_interval_write(data, val);
 	default:
 		return -EOPNOTSUPP;
 	}
 }
 
+/*
+ * The IIO front end is only built with AM2320_IIO, as it makes the module
+ * depend on industrialio and industrialio-triggered-buffer.
+ */
+#if defined(AM2320_IIO) && IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+enum am2320_iio_scan {
+	AM2320_SCAN_TEMP,
+	AM2320_SCAN_HUMIDITY,
+	AM2320_SCAN_TIMESTAMP,
+};
+
+static const struct iio_chan_spec am2320_iio_channels[] = {
+	{
+		.type = IIO_TEMP,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED),
+		.scan_index = AM2320_SCAN_TEMP,
+		.scan_type = {
+			.sign = 's',
+			.realbits = 32,
+			.storagebits = 32,
+			.endianness = IIO_CPU,
+		},
+	},
+	{
+		.type = IIO_HUMIDITYRELATIVE,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED),
+		.scan_index = AM2320_SCAN_HUMIDITY,
+		.scan_type = {
+			.sign = 's',
+			.realbits = 32,
+			.storagebits = 32,
+			.endianness = IIO_CPU,
+		},
+	},
+	IIO_CHAN_SOFT_TIMESTAMP(AM2320_SCAN_TIMESTAMP),
+};
+
+/* Both channels come from the same frame, let the core demux them */
+static const unsigned long am2320_iio_scan_masks[] = {
+	BIT(AM2320_SCAN_TEMP) | BIT(AM2320_SCAN_HUMIDITY),
+	0,
+};
+
+static int am2320_iio_read_raw(struct iio_dev *indio_dev,
+			       struct iio_chan_spec const *chan,
+			       int *val, int *val2, long mask)
+{
+	struct am2320_data **priv = iio_priv(indio_dev);
+	struct am2320_sample sample;
+	int res;
+
+	if (mask != IIO_CHAN_INFO_PROCESSED)
+		return -EINVAL;
+
+	res = am2320_read_values(*priv, &sample);
+	if (res < 0)
+		return res;
+
+	if (chan->type == IIO_TEMP)
+		*val = sample.temperature;
+	else
+		*val = sample.humidity;
+
+	return IIO_VAL_INT;
+}
+
+static irqreturn_t am2320_iio_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct am2320_data **priv = iio_priv(indio_dev);
+	struct am2320_sample sample;
+	struct {
+		s32 channels[2];
+		s64 timestamp __aligned(8);
+	} scan = { };
+
+	if (!am2320_read_values(*priv, &sample)) {
+		scan.channels[0] = sample.temperature;
+		scan.channels[1] = sample.humidity;
+		iio_push_to_buffers_with_timestamp(indio_dev, &scan,
+						   pf->timestamp);
+	}
+
+	iio_trigger_notify_done(indio_dev->trig);
+
+	return IRQ_HANDLED;
+}
+
+static const struct iio_info am2320_iio_info = {
+	.read_raw = am2320_iio_read_raw,
+};
+
+/*
+ * am2320_iio_init() - register the IIO front end sharing the hwmon sample
+ */
+static int am2320_iio_init(struct am2320_data *data)
+{
+	struct device *device = &data->client->dev;
+	struct am2320_data **priv;
+	struct iio_dev *indio_dev;
+	int res;
+
+	indio_dev = devm_iio_device_alloc(device, sizeof(*priv));
+	if (!indio_dev)
+		return -ENOMEM;
+
+	priv = iio_priv(indio_dev);
+	*priv = data;
+
+	indio_dev->name = data->client->name;
+	indio_dev->info = &am2320_iio_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = am2320_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(am2320_iio_channels);
+	indio_dev->available_scan_masks = am2320_iio_scan_masks;
+
+	res = devm_iio_triggered_buffer_setup(device, indio_dev,
+					      iio_pollfunc_store_time,
+					      am2320_iio_trigger_handler, NULL);
+	if (res)
+		return res;
+
+	return devm_iio_device_register(device, indio_dev);
+}
+#else
+static int am2320_iio_init(struct am2320_data *data)
+{
+	dev_warn(&data->client->dev,
+		 "IIO support is not available, build with AM2320_IIO=y\n");
+	return 0;
+}
+#endif
+
+static int am2320_sample_age_get(void *arg, u64 *val)
+{
+	struct am2320_data *data = arg;
+	struct am2320_sample sample;
+
+	am2320_sample_get(data, &sample);
+	if (!sample.time)
+		return -ENODATA;
+
+	*val = am2320_sample_age(&sample);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(am2320_sample_age_fops, am2320_sample_age_get, NULL,
+			 "%llu\n");
+
+static int am2320_stats_show(struct seq_file *s, void *unused)
+{
+	struct am2320_data *data = s->private;
+
+	for (int i = 0; i < AM2320_NUM_STATS; i++)
+		seq_printf(s, "%s %lld\n", am2320_stat_names[i],
+			   atomic64_read(&data->stats.counters[i]));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(am2320_stats);
+
+/*
+ * am2320_latency_show() - print a histogram as "<upper bound in us> <count>"
+ */
+static void am2320_latency_show(struct seq_file *s, atomic64_t *hist)
+{
+	for (int i = 0; i < AM2320_LATENCY_BUCKETS - 1; i++)
+		seq_printf(s, "%lu %lld\n", BIT(i), atomic64_read(&hist[i]));
+	seq_printf(s, "inf %lld\n",
+		   atomic64_read(&hist[AM2320_LATENCY_BUCKETS - 1]));
+}
+
+static int am2320_refresh_latency_show(struct seq_file *s, void *unused)
+{
+	struct am2320_data *data = s->private;
+
+	am2320_latency_show(s, data->stats.refresh_latency);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(am2320_refresh_latency);
+
+static int am2320_lock_wait_show(struct seq_file *s, void *unused)
+{
+	struct am2320_data *data = s->private;
+
+	am2320_latency_show(s, data->stats.lock_wait);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(am2320_lock_wait);
+
+/*
+ * am2320_stats_reset() - zero all statistics on any write
+ */
+static int am2320_stats_reset(void *arg, u64 val)
+{
+	struct am2320_data *data = arg;
+	struct am2320_stats *stats = &data->stats;
+
+	for (int i = 0; i < AM2320_NUM_STATS; i++)
+		atomic64_set(&stats->counters[i], 0);
+
+	for (int i = 0; i < AM2320_LATENCY_BUCKETS; i++) {
+		atomic64_set(&stats->refresh_latency[i], 0);
+		atomic64_set(&stats->lock_wait[i], 0);
+	}
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(am2320_stats_reset_fops, NULL, am2320_stats_reset,
+			 "%llu\n");
+
+/*
+ * am2320_devices_show() - one line per bound sensor, from its latest sample
+ * Reading this never touches the bus.
+ */
+static int am2320_devices_show(struct seq_file *s, void *unused)
+{
+	struct am2320_sample sample;
+	struct am2320_data *data;
+
+	mutex_lock(&am2320_devices_lock);
+	list_for_each_entry(data, &am2320_devices, node) {
+		struct i2c_client *client = data->client;
+
+		am2320_sample_get(data, &sample);
+
+		seq_printf(s, "%s adapter=%d addr=0x%02x status=%d",
+			   dev_name(&client->dev),
+			   i2c_adapter_id(client->adapter), client->addr,
+			   sample.time ? sample.status : -ENODATA);
+		if (sample.time)
+			seq_printf(s, " temp1_input=%d humidity1_input=%d sample_age_ms=%lld",
+				   sample.temperature, sample.humidity,
+				   am2320_sample_age(&sample));
+		seq_putc(s, '\n');
+	}
+	mutex_unlock(&am2320_devices_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(am2320_devices);
+
+static void am2320_devices_del(void *arg)
+{
+	struct am2320_data *data = arg;
+
+	mutex_lock(&am2320_devices_lock);
+	list_del(&data->node);
+	mutex_unlock(&am2320_devices_lock);
+}
+
+/*
+ * am2320_devices_add() - list the sensor in the driver-wide view
+ */
+static int am2320_devices_add(struct am2320_data *data)
+{
+	mutex_lock(&am2320_devices_lock);
+	list_add_tail(&data->node, &am2320_devices);
+	mutex_unlock(&am2320_devices_lock);
+
+	return devm_add_action_or_reset(&data->client->dev,
+					am2320_devices_del, data);
+}
+
+static void am2320_debugfs_init(struct am2320_data *data)
+{
+	struct dentry *dir = data->client->debugfs;
+
+	debugfs_create_file("stats", 0444, dir, data, &am2320_stats_fops);
+	debugfs_create_file("refresh_latency_us", 0444, dir, data,
+			    &am2320_refresh_latency_fops);
+	debugfs_create_file("lock_wait_us", 0444, dir, data,
+			    &am2320_lock_wait_fops);
+	debugfs_create_file_unsafe("reset", 0200, dir, data,
+				   &am2320_stats_reset_fops);
+	debugfs_create_u32("sample_xfers", 0444, dir, &data->sample_xfers);
+	debugfs_create_u64("bus_held_ns", 0444, dir, &data->bus_held_ns);
+	debugfs_create_u64("bus_idle_ns", 0444, dir, &data->bus_idle_ns);
+	debugfs_create_u32("meas_delay_us", 0444, dir, &data->meas_delay);
+	debugfs_create_u32("failures", 0444, dir, &data->failures);
+	debugfs_create_u32("backoff_ms", 0444, dir, &data->backoff_ms);
+	debugfs_create_file_unsafe("sample_age_ms", 0444, dir, data,
+				   &am2320_sample_age_fops);
+}
+
 static const struct hwmon_channel_info *const am2320_info[] = {
-	HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL),
-	HWMON_CHANNEL_INFO(temp, HWMON_T_INPUT),
-	HWMON_CHANNEL_INFO(humidity, HWMON_H_INPUT),
+	HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL |
+			   HWMON_C_RESET_HISTORY | HWMON_C_SAMPLES),
+	HWMON_CHANNEL_INFO(temp, HWMON_T_INPUT |
+			   HWMON_T_LOWEST | HWMON_T_HIGHEST |
+			   HWMON_T_RESET_HISTORY |
+			   HWMON_T_MIN | HWMON_T_MAX | HWMON_T_CRIT |
+			   HWMON_T_MIN_HYST | HWMON_T_MAX_HYST |
+			   HWMON_T_CRIT_HYST |
+			   HWMON_T_MIN_ALARM | HWMON_T_MAX_ALARM |
+			   HWMON_T_CRIT_ALARM,
+			   HWMON_T_INPUT | HWMON_T_LABEL),
+	HWMON_CHANNEL_INFO(humidity, HWMON_H_INPUT |
+			   HWMON_H_MIN | HWMON_H_MAX |
+			   HWMON_H_MIN_HYST | HWMON_H_MAX_HYST |
+			   HWMON_H_MIN_ALARM | HWMON_H_MAX_ALARM),
+	NULL,
+};
+
+/*
+ * hwmon has no lowest/highest for humidity and no averages at all,
+ * these are provided as extra attributes.
+ */
+static ssize_t am2320_history_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct am2320_data *data = dev_get_drvdata(dev);
+	long val;
+	int res;
+
+	res = am2320_history_read(data, sattr->nr, sattr->index, &val);
+	if (res < 0)
+		return res;
+
+	return sysfs_emit(buf, "%ld\n", val);
+}
+
+static ssize_t humidity1_absolute_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct am2320_data *data = dev_get_drvdata(dev);
+	struct am2320_sample sample;
+	int res;
+
+	res = am2320_read_values(data, &sample);
+	if (res < 0)
+		return res;
+
+	return sysfs_emit(buf, "%d\n", sample.absolute_humidity);
+}
+
+/*
+ * metrics_show() - everything an exporter needs in a single read
+ * One key=value pair per line. The values are only present once the first
+ * sample has landed. Keys may be added but are never renamed.
+ */
+static ssize_t metrics_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct am2320_data *data = dev_get_drvdata(dev);
+	struct am2320_sample sample;
+	int len = 0;
+	int res;
+
+	res = am2320_read_values(data, &sample);
+
+	len += sysfs_emit_at(buf, len, "status=%d\n", res);
+	if (sample.time) {
+		len += sysfs_emit_at(buf, len, "temp1_input=%d\n",
+				     sample.temperature);
+		len += sysfs_emit_at(buf, len, "humidity1_input=%d\n",
+				     sample.humidity);
+		len += sysfs_emit_at(buf, len, "temp2_input=%d\n",
+				     sample.dew_point);
+		len += sysfs_emit_at(buf, len, "humidity1_absolute=%d\n",
+				     sample.absolute_humidity);
+		len += sysfs_emit_at(buf, len, "sample_age_ms=%lld\n",
+				     am2320_sample_age(&sample));
+	}
+	len += sysfs_emit_at(buf, len, "seq=%u\n", sample.seq);
+
+	for (int i = 0; i < AM2320_NUM_LIMITS; i++) {
+		len += sysfs_emit_at(buf, len, "%s=%d\n", am2320_limits[i].name,
+				     READ_ONCE(data->limits[i]));
+		len += sysfs_emit_at(buf, len, "%s_hyst=%d\n",
+				     am2320_limits[i].name,
+				     am2320_hyst_read(data, i));
+		len += sysfs_emit_at(buf, len, "%s_alarm=%d\n",
+				     am2320_limits[i].name,
+				     test_bit(i, &data->alarms));
+	}
+
+	len += sysfs_emit_at(buf, len, "update_interval=%lld\n",
+			     ktime_to_ms(data->min_poll_interval));
+	len += sysfs_emit_at(buf, len, "samples=%u\n",
+			     READ_ONCE(data->samples));
+	len += sysfs_emit_at(buf, len, "failures=%u\n",
+			     READ_ONCE(data->failures));
+	len += sysfs_emit_at(buf, len, "backoff_ms=%u\n",
+			     READ_ONCE(data->backoff_ms));
+
+	for (int i = 0; i < AM2320_NUM_STATS; i++)
+		len += sysfs_emit_at(buf, len, "%s=%lld\n",
+				     am2320_stat_names[i],
+				     atomic64_read(&data->stats.counters[i]));
+
+	return len;
+}
+
+static ssize_t am2320_reset_history_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct sensor_device_attribute *sattr = to_sensor_dev_attr(attr);
+	struct am2320_data *data = dev_get_drvdata(dev);
+
+	am2320_history_reset(data, sattr->index);
+	return count;
+}
+
+static SENSOR_DEVICE_ATTR_2_RO(temp1_average, am2320_history,
+			       AM2320_CHAN_TEMP, AM2320_HIST_AVERAGE);
+static SENSOR_DEVICE_ATTR_2_RO(humidity1_lowest, am2320_history,
+			       AM2320_CHAN_HUMIDITY, AM2320_HIST_LOWEST);
+static SENSOR_DEVICE_ATTR_2_RO(humidity1_highest, am2320_history,
+			       AM2320_CHAN_HUMIDITY, AM2320_HIST_HIGHEST);
+static SENSOR_DEVICE_ATTR_2_RO(humidity1_average, am2320_history,
+			       AM2320_CHAN_HUMIDITY, AM2320_HIST_AVERAGE);
+static SENSOR_DEVICE_ATTR_WO(humidity1_reset_history, am2320_reset_history,
+			     AM2320_CHAN_HUMIDITY);
+static DEVICE_ATTR_RO(humidity1_absolute);
+static DEVICE_ATTR_RO(metrics);
+
+static struct attribute *am2320_attrs[] = {
+	&sensor_dev_attr_temp1_average.dev_attr.attr,
+	&sensor_dev_attr_humidity1_lowest.dev_attr.attr,
+	&sensor_dev_attr_humidity1_highest.dev_attr.attr,
+	&sensor_dev_attr_humidity1_average.dev_attr.attr,
+	&sensor_dev_attr_humidity1_reset_history.dev_attr.attr,
+	&dev_attr_humidity1_absolute.attr,
+	&dev_attr_metrics.attr,
 	NULL,
 };
+ATTRIBUTE_GROUPS(am2320);
 
 static const struct hwmon_ops am2320_hwmon_ops = {
 	.is_visible = am2320_hwmon_visible,
 	.read = am2320_hwmon_read,
+	.read_string = am2320_hwmon_read_string,
 	.write = am2320_hwmon_write,
 };
 
@@ -303,17 +2628,59 @@ static int am2320_probe(struct i2c_client *client)
 
 	data->min_poll_interval = ms_to_ktime(AM2320_DEFAULT_MIN_POLL_INTERVAL);
 	data->client = client;
+	data->meas_delay = AM2320_MEAS_DELAY - AM2320_MEAS_DELAY_MARGIN;
+	data->samples = 1;
+	for (int i = 0; i < AM2320_NUM_LIMITS; i++) {
+		data->limits[i] = am2320_limits[i].initial;
+		data->hyst[i] = am2320_limits[i].type == hwmon_temp ?
+				AM2320_TEMP_HYST : AM2320_HUMIDITY_HYST;
+	}
+	data->ignore_nak = i2c_check_functionality(client->adapter,
+						   I2C_FUNC_PROTOCOL_MANGLING);
 
 	mutex_init(&data->lock);
+	seqcount_mutex_init(&data->seq, &data->lock);
+	INIT_DELAYED_WORK(&data->work, am2320_work);
+	spin_lock_init(&data->flight_lock);
+	init_waitqueue_head(&data->flight_wq);
 
-	res = am2320_read_values(data);
-	if (res < 0)
+	/* Before the worker is started, it publishes into the cdev state */
+	res = am2320_cdev_alloc(data);
+	if (res)
 		return res;
 
 	hwmon_dev = devm_hwmon_device_register_with_info(
-		device, client->name, data, &am2320_chip_info, NULL);
+		device, client->name, data, &am2320_chip_info, am2320_groups);
+	if (IS_ERR(hwmon_dev))
+		return PTR_ERR(hwmon_dev);
+
+	data->hwmon_dev = hwmon_dev;
+
+	/* The worker notifies the hwmon device, stop it before that goes */
+	res = devm_add_action_or_reset(device, am2320_cancel_work, data);
+	if (res)
+		return res;
+
+	/* Take the first sample in the background, reads fail until then */
+	queue_delayed_work(system_freezable_wq, &data->work, 0);
+
+	if (iio) {
+		res = am2320_iio_init(data);
+		if (res)
+			return res;
+	}
+
+	res = am2320_cdev_init(data);
+	if (res)
+		return res;
+
+	res = am2320_devices_add(data);
+	if (res)
+		return res;
+
+	am2320_debugfs_init(data);
 
-	return PTR_ERR_OR_ZERO(hwmon_dev);
+	return 0;
 }
 
 static const struct i2c_device_id am2320_id[] = {
@@ -336,13 +2703,50 @@ static struct i2c_driver am2320_driver = {
 	.driver = {
 		.name = "am2320",
 		.of_match_table = of_match_ptr(am2320_of_match),
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe      = am2320_probe,
 	.id_table   = am2320_id,
 };
 
-module_i2c_driver(am2320_driver);
+static int __init am2320_init(void)
+{
+	int res;
+
+	if (netlink) {
+		res = genl_register_family(&am2320_genl_family);
+		if (res)
+			return res;
+	}
+
+	am2320_debugfs_root = debugfs_create_dir("am2320", NULL);
+	debugfs_create_file("devices", 0444, am2320_debugfs_root, NULL,
+			    &am2320_devices_fops);
+
+	res = i2c_add_driver(&am2320_driver);
+	if (res) {
+		debugfs_remove_recursive(am2320_debugfs_root);
+		if (netlink)
+			genl_unregister_family(&am2320_genl_family);
+	}
+
+	return res;
+}
+module_init(am2320_init);
+
+static void __exit am2320_exit(void)
+{
+	i2c_del_driver(&am2320_driver);
+	debugfs_remove_recursive(am2320_debugfs_root);
+	if (netlink)
+		genl_unregister_family(&am2320_genl_family);
+}
+module_exit(am2320_exit);
 
 MODULE_AUTHOR("Stephen Horvath <s.horvath@outlook.com.au>");
 MODULE_DESCRIPTION("AM2320 Temperature and Humidity sensor driver");
 MODULE_LICENSE("GPL v2");
+
+#if defined(AM2320_KUNIT_TEST) && IS_ENABLED(CONFIG_KUNIT)
+#include "am2320_kunit.c"
+#endif
@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: GPL-2.0-only WITH Linux-syscall-note */
+
+/*
+ * am2320.h - Userspace interface of the AM232X hwmon driver
+ * Copyright (C) 2025 Stephen Horvath
+ *
+ * Shared by the driver and its userspace consumers, everything in here is
+ * ABI.
+ */
+
+#ifndef _AM2320_H
+#define _AM2320_H
+
+#include <linux/types.h>
+
+/**
+ *   struct am2320_record - The binary record read from the character device
+ *   @temperature: The temperature in millidegrees
+ *   @humidity: The relative humidity in millipercent
+ *   @timestamp: CLOCK_BOOTTIME of the last good sample in nanoseconds
+ *   @status: The result of the latest refresh, 0 or a negative errno
+ *   @seq: Incremented on every refresh, successful or not
+ *
+ * The values are those of the last good sample.
+ */
+struct am2320_record {
+	__s32 temperature;
+	__s32 humidity;
+	__u64 timestamp;
+	__s32 status;
+	__u32 seq;
+};
+
+/**
+ *   struct am2320_shared - The sample page mapped by the character device
+ *   @lock: Odd while the kernel updates the page, re-read if it changed
+ *   @seq: Incremented on every refresh, successful or not
+ *   @temperature: The temperature in millidegrees
+ *   @humidity: The relative humidity in millipercent
+ *   @timestamp: CLOCK_BOOTTIME of the last good sample in nanoseconds
+ *   @status: The result of the latest refresh, 0 or a negative errno
+ *   @reserved: Always 0
+ *
+ * Read @lock, skip if it is odd, read the fields, then read @lock again and
+ * retry if it changed, with read barriers in between.
+ */
+struct am2320_shared {
+	__u32 lock;
+	__u32 seq;
+	__s32 temperature;
+	__s32 humidity;
+	__u64 timestamp;
+	__s32 status;
+	__u32 reserved;
+};
+
+/*
+ * Generic netlink family multicasting every sample to the samples group
+ */
+#define AM2320_GENL_NAME		"am2320"
+#define AM2320_GENL_VERSION		1
+#define AM2320_GENL_MCGRP_SAMPLES	"samples"
+
+enum am2320_genl_attr {
+	AM2320_ATTR_UNSPEC,
+	AM2320_ATTR_DEVICE,		/* string, the i2c device name */
+	AM2320_ATTR_ADAPTER,		/* u32 */
+	AM2320_ATTR_ADDR,		/* u16 */
+	AM2320_ATTR_TEMPERATURE,	/* s32, millidegrees */
+	AM2320_ATTR_HUMIDITY,		/* s32, millipercent */
+	AM2320_ATTR_TIMESTAMP,		/* u64, CLOCK_BOOTTIME in ns */
+	AM2320_ATTR_STATUS,		/* s32, 0 or negative errno */
+	AM2320_ATTR_SEQ,		/* u32 */
+	AM2320_ATTR_PAD,
+	__AM2320_ATTR_MAX,
+};
+#define AM2320_ATTR_MAX (__AM2320_ATTR_MAX - 1)
+
+enum am2320_genl_cmd {
+	AM2320_CMD_UNSPEC,
+	AM2320_CMD_SAMPLE,		/* a new sample, multicast only */
+};
+
+#endif /* _AM2320_H */
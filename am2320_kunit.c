@@ -0,0 +1,306 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+/*
+ * am2320_kunit.c - KUnit tests for the AM2320 driver
+ *
+ * Included at the end of am2320.c so the static helpers can be tested,
+ * build with 'make AM2320_KUNIT=y' and load the module to run them. Run
+ * with KASAN to catch the character device state being used after free.
+ */
+
+#include <kunit/test.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/random.h>
+#include <linux/timex.h>
+
+#define AM2320_TEST_BENCH_LOOPS	100000
+#define AM2320_TEST_TIMEOUT	(2 * HZ)
+
+/*
+ * Measurement response from the datasheet: 50.0 %RH and 25.0 degrees
+ */
+static const u8 am2320_test_frame[AM2320_FRAME_SIZE] = {
+	0x03, 0x04, 0x01, 0xF4, 0x00, 0xFA, 0x31, 0xA5,
+};
+
+static void am2320_crc16_datasheet_test(struct kunit *test)
+{
+	u8 frame[AM2320_FRAME_SIZE];
+	u16 crc;
+
+	memcpy(frame, am2320_test_frame, sizeof(frame));
+	crc = get_unaligned_le16(&frame[AM2320_FRAME_SIZE - 2]);
+
+	KUNIT_EXPECT_EQ(test, crc, 0xA531);
+	KUNIT_EXPECT_EQ(test, am2320_crc16(frame, AM2320_FRAME_SIZE - 2), crc);
+	KUNIT_EXPECT_EQ(test,
+			am2320_crc16_bitwise(frame, AM2320_FRAME_SIZE - 2),
+			crc);
+
+	/* A single flipped bit must be caught */
+	frame[3] ^= 0x01;
+	KUNIT_EXPECT_NE(test, am2320_crc16(frame, AM2320_FRAME_SIZE - 2), crc);
+}
+
+static void am2320_crc16_table_test(struct kunit *test)
+{
+#ifdef AM2320_CRC16_BITWISE
+	kunit_skip(test, "built with the bitwise CRC16");
+#else
+	/*
+	 * From the 0xFFFF seed, a single byte b gives
+	 * 0x00FF ^ table[0xFF ^ b], so every entry can be derived from the
+	 * bitwise reference.
+	 */
+	for (unsigned int i = 0; i < ARRAY_SIZE(am2320_crc16_table); i++) {
+		u8 byte = 0xFF ^ i;
+
+		KUNIT_EXPECT_EQ_MSG(test, am2320_crc16_table[i],
+				    am2320_crc16_bitwise(&byte, 1) ^ 0x00FF,
+				    "entry %u", i);
+	}
+#endif
+}
+
+static void am2320_crc16_random_test(struct kunit *test)
+{
+	u8 frame[AM2320_FRAME_SIZE - 2];
+
+	for (int i = 0; i < 1000; i++) {
+		get_random_bytes(frame, sizeof(frame));
+		KUNIT_ASSERT_EQ(test, am2320_crc16(frame, sizeof(frame)),
+				am2320_crc16_bitwise(frame, sizeof(frame)));
+	}
+}
+
+/*
+ * am2320_crc16_bench() - report the cost of checking one frame
+ * get_cycles() reads 0 on architectures without a cycle counter, the time
+ * per frame is reported as well.
+ */
+static void am2320_crc16_bench(struct kunit *test, const char *name,
+			       int (*crc16)(u8 *raw_data, int count))
+{
+	u8 frame[AM2320_FRAME_SIZE - 2];
+	cycles_t cycles;
+	ktime_t start;
+	u32 sink = 0;
+
+	memcpy(frame, am2320_test_frame, sizeof(frame));
+
+	start = ktime_get();
+	cycles = get_cycles();
+	for (u32 i = 0; i < AM2320_TEST_BENCH_LOOPS; i++) {
+		frame[5] = i;
+		sink += crc16(frame, sizeof(frame));
+	}
+	cycles = get_cycles() - cycles;
+
+	kunit_info(test, "%s: %llu cycles, %llu ns per frame (sum %x)\n",
+		   name, div_u64(cycles, AM2320_TEST_BENCH_LOOPS),
+		   div_u64(ktime_to_ns(ktime_sub(ktime_get(), start)),
+			   AM2320_TEST_BENCH_LOOPS), sink);
+}
+
+static void am2320_crc16_bench_test(struct kunit *test)
+{
+	am2320_crc16_bench(test, "am2320_crc16", am2320_crc16);
+	am2320_crc16_bench(test, "am2320_crc16_bitwise", am2320_crc16_bitwise);
+}
+
+/**
+ *   struct am2320_test_read - A blocking read run from a separate thread
+ *   @reader: The reader to read with
+ *   @record: The record that was read
+ *   @res: The result of the read
+ *   @done: Completed once the read has returned
+ */
+struct am2320_test_read {
+	struct am2320_reader reader;
+	struct am2320_record record;
+	int res;
+	struct completion done;
+};
+
+static int am2320_test_read_fn(void *arg)
+{
+	struct am2320_test_read *read = arg;
+
+	read->res = am2320_cdev_next(&read->reader, &read->record, false);
+	complete(&read->done);
+
+	return 0;
+}
+
+/*
+ * am2320_test_read_start() - open a reader and block it in a read
+ * The test fails unless the thread ends up sleeping on the wait queue.
+ */
+static void am2320_test_read_start(struct kunit *test,
+				   struct am2320_cdev *cdev,
+				   struct am2320_test_read *read, u32 seq)
+{
+	struct task_struct *task;
+	unsigned long timeout = jiffies + AM2320_TEST_TIMEOUT;
+
+	kref_get(&cdev->kref);
+	read->reader.cdev = cdev;
+	read->reader.seq = seq;
+	init_completion(&read->done);
+
+	task = kthread_run(am2320_test_read_fn, read, "am2320-test");
+	KUNIT_ASSERT_FALSE(test, IS_ERR(task));
+
+	while (!waitqueue_active(&cdev->sample_wq) &&
+	       time_before(jiffies, timeout))
+		msleep(1);
+	KUNIT_EXPECT_TRUE(test, waitqueue_active(&cdev->sample_wq));
+	KUNIT_EXPECT_FALSE(test, completion_done(&read->done));
+}
+
+/*
+ * am2320_test_read_finish() - wait for the blocked read and close the reader
+ * A read that never returns is released by unplugging the device, so the
+ * thread never outlives the test.
+ */
+static void am2320_test_read_finish(struct kunit *test,
+				    struct am2320_cdev *cdev,
+				    struct am2320_test_read *read)
+{
+	if (!wait_for_completion_timeout(&read->done, AM2320_TEST_TIMEOUT)) {
+		am2320_cdev_unplug(cdev);
+		wait_for_completion(&read->done);
+		KUNIT_FAIL(test, "blocked read was not woken up");
+	}
+
+	am2320_cdev_put(cdev);
+}
+
+static void am2320_test_publish(struct am2320_cdev *cdev, u32 seq)
+{
+	struct am2320_record record = {
+		.temperature = 25000,
+		.humidity = 50000,
+		.timestamp = (u64)seq * NSEC_PER_SEC,
+		.seq = seq,
+	};
+
+	am2320_cdev_publish(cdev, &record);
+}
+
+static void am2320_cdev_read_test(struct kunit *test)
+{
+	struct am2320_cdev *cdev = am2320_cdev_create();
+	struct am2320_reader reader = { .cdev = cdev };
+	struct am2320_record record;
+
+	KUNIT_ASSERT_NOT_NULL(test, cdev);
+
+	/* Nothing was published yet */
+	KUNIT_EXPECT_EQ(test, am2320_cdev_next(&reader, &record, true),
+			-EAGAIN);
+
+	am2320_test_publish(cdev, 1);
+	KUNIT_EXPECT_EQ(test, am2320_cdev_next(&reader, &record, true), 0);
+	KUNIT_EXPECT_EQ(test, record.seq, 1);
+	KUNIT_EXPECT_EQ(test, record.temperature, 25000);
+	KUNIT_EXPECT_EQ(test, record.humidity, 50000);
+
+	/* Each record is only returned once */
+	KUNIT_EXPECT_EQ(test, am2320_cdev_next(&reader, &record, true),
+			-EAGAIN);
+
+	am2320_cdev_put(cdev);
+}
+
+static void am2320_cdev_blocking_test(struct kunit *test)
+{
+	struct am2320_cdev *cdev = am2320_cdev_create();
+	struct am2320_test_read read;
+
+	KUNIT_ASSERT_NOT_NULL(test, cdev);
+
+	/* A new record wakes up a blocked reader */
+	am2320_test_read_start(test, cdev, &read, 0);
+	am2320_test_publish(cdev, 1);
+	am2320_test_read_finish(test, cdev, &read);
+	KUNIT_EXPECT_EQ(test, read.res, 0);
+	KUNIT_EXPECT_EQ(test, read.record.seq, 1);
+
+	/* Unbinding the sensor wakes it up with -ENODEV */
+	am2320_test_read_start(test, cdev, &read, 1);
+	am2320_cdev_unplug(cdev);
+	am2320_test_read_finish(test, cdev, &read);
+	KUNIT_EXPECT_EQ(test, read.res, -ENODEV);
+
+	am2320_cdev_put(cdev);
+}
+
+static void am2320_cdev_poll_test(struct kunit *test)
+{
+	struct am2320_cdev *cdev = am2320_cdev_create();
+	struct am2320_reader reader = { .cdev = cdev };
+	struct am2320_record record;
+
+	KUNIT_ASSERT_NOT_NULL(test, cdev);
+
+	KUNIT_EXPECT_EQ(test, am2320_cdev_poll_mask(&reader), 0);
+
+	am2320_test_publish(cdev, 1);
+	KUNIT_EXPECT_EQ(test, am2320_cdev_poll_mask(&reader),
+			EPOLLIN | EPOLLRDNORM);
+
+	KUNIT_EXPECT_EQ(test, am2320_cdev_next(&reader, &record, true), 0);
+	KUNIT_EXPECT_EQ(test, am2320_cdev_poll_mask(&reader), 0);
+
+	am2320_cdev_unplug(cdev);
+	KUNIT_EXPECT_EQ(test, am2320_cdev_poll_mask(&reader),
+			EPOLLHUP | EPOLLERR);
+
+	am2320_cdev_put(cdev);
+}
+
+static void am2320_cdev_close_after_unbind_test(struct kunit *test)
+{
+	struct am2320_cdev *cdev = am2320_cdev_create();
+	struct am2320_reader reader = { .cdev = cdev };
+	struct am2320_record record;
+
+	KUNIT_ASSERT_NOT_NULL(test, cdev);
+
+	/* An open file, then the sensor unbinds and drops its reference */
+	kref_get(&cdev->kref);
+	am2320_test_publish(cdev, 1);
+	am2320_cdev_unplug(cdev);
+	am2320_cdev_put(cdev);
+
+	/* The file still holds the state, which now fails every access */
+	KUNIT_EXPECT_EQ(test, kref_read(&cdev->kref), 1);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(cdev->shared->seq), 1);
+	KUNIT_EXPECT_EQ(test, am2320_cdev_next(&reader, &record, true),
+			-ENODEV);
+	KUNIT_EXPECT_EQ(test, am2320_cdev_poll_mask(&reader),
+			EPOLLHUP | EPOLLERR);
+
+	/* Closing it frees the state */
+	am2320_cdev_put(cdev);
+}
+
+static struct kunit_case am2320_test_cases[] = {
+	KUNIT_CASE(am2320_crc16_datasheet_test),
+	KUNIT_CASE(am2320_crc16_table_test),
+	KUNIT_CASE(am2320_crc16_random_test),
+	KUNIT_CASE_SLOW(am2320_crc16_bench_test),
+	KUNIT_CASE(am2320_cdev_read_test),
+	KUNIT_CASE(am2320_cdev_blocking_test),
+	KUNIT_CASE(am2320_cdev_poll_test),
+	KUNIT_CASE(am2320_cdev_close_after_unbind_test),
+	{ }
+};
+
+static struct kunit_suite am2320_test_suite = {
+	.name = "am2320",
+	.test_cases = am2320_test_cases,
+};
+kunit_test_suite(am2320_test_suite);
@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+/*
+ * am2320_trace.h - Tracepoints for the AM232X hwmon driver
+ * Copyright (C) 2025 Stephen Horvath
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM am2320
+
+#if !defined(_AM2320_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AM2320_TRACE_H
+
+#include <linux/i2c.h>
+#include <linux/tracepoint.h>
+
+#define AM2320_TP_STRUCT__client			\
+	__field(int, adapter)				\
+	__field(u16, addr)
+
+#define AM2320_TP_fast_assign_client(client)		\
+	__entry->adapter = i2c_adapter_id((client)->adapter);	\
+	__entry->addr = (client)->addr
+
+#define AM2320_TP_printk_client				\
+	"i2c-%d-%04x"
+
+#define AM2320_TP_printk_client_args			\
+	__entry->adapter, __entry->addr
+
+TRACE_EVENT(am2320_lock,
+	TP_PROTO(const struct i2c_client *client, s64 wait_ns),
+	TP_ARGS(client, wait_ns),
+	TP_STRUCT__entry(
+		AM2320_TP_STRUCT__client
+		__field(s64, wait_ns)
+	),
+	TP_fast_assign(
+		AM2320_TP_fast_assign_client(client);
+		__entry->wait_ns = wait_ns;
+	),
+	TP_printk(AM2320_TP_printk_client " wait_ns=%lld",
+		  AM2320_TP_printk_client_args, __entry->wait_ns)
+);
+
+DECLARE_EVENT_CLASS(am2320_result,
+	TP_PROTO(const struct i2c_client *client, int res),
+	TP_ARGS(client, res),
+	TP_STRUCT__entry(
+		AM2320_TP_STRUCT__client
+		__field(int, res)
+	),
+	TP_fast_assign(
+		AM2320_TP_fast_assign_client(client);
+		__entry->res = res;
+	),
+	TP_printk(AM2320_TP_printk_client " res=%d",
+		  AM2320_TP_printk_client_args, __entry->res)
+);
+
+/* The wake-up is expected to be NAKed, its result is informational */
+DEFINE_EVENT(am2320_result, am2320_wake,
+	TP_PROTO(const struct i2c_client *client, int res),
+	TP_ARGS(client, res)
+);
+
+DEFINE_EVENT(am2320_result, am2320_command,
+	TP_PROTO(const struct i2c_client *client, int res),
+	TP_ARGS(client, res)
+);
+
+DEFINE_EVENT(am2320_result, am2320_frame,
+	TP_PROTO(const struct i2c_client *client, int res),
+	TP_ARGS(client, res)
+);
+
+/* The frame was NAKed where that is expected, the sensor wasn't ready */
+DEFINE_EVENT(am2320_result, am2320_not_ready,
+	TP_PROTO(const struct i2c_client *client, int res),
+	TP_ARGS(client, res)
+);
+
+TRACE_EVENT(am2320_sleep,
+	TP_PROTO(const struct i2c_client *client, unsigned int delay_us,
+		 s64 slept_ns),
+	TP_ARGS(client, delay_us, slept_ns),
+	TP_STRUCT__entry(
+		AM2320_TP_STRUCT__client
+		__field(unsigned int, delay_us)
+		__field(s64, slept_ns)
+	),
+	TP_fast_assign(
+		AM2320_TP_fast_assign_client(client);
+		__entry->delay_us = delay_us;
+		__entry->slept_ns = slept_ns;
+	),
+	TP_printk(AM2320_TP_printk_client " delay_us=%u slept_ns=%lld",
+		  AM2320_TP_printk_client_args, __entry->delay_us,
+		  __entry->slept_ns)
+);
+
+TRACE_EVENT(am2320_check,
+	TP_PROTO(const struct i2c_client *client, const u8 *frame, u16 crc,
+		 u16 expected),
+	TP_ARGS(client, frame, crc, expected),
+	TP_STRUCT__entry(
+		AM2320_TP_STRUCT__client
+		__field(u8, func)
+		__field(u8, len)
+		__field(u16, crc)
+		__field(u16, expected)
+	),
+	TP_fast_assign(
+		AM2320_TP_fast_assign_client(client);
+		__entry->func = frame[0];
+		__entry->len = frame[1];
+		__entry->crc = crc;
+		__entry->expected = expected;
+	),
+	TP_printk(AM2320_TP_printk_client
+		  " func=0x%02x len=%u crc=0x%04x expected=0x%04x",
+		  AM2320_TP_printk_client_args, __entry->func, __entry->len,
+		  __entry->crc, __entry->expected)
+);
+
+TRACE_EVENT(am2320_publish,
+	TP_PROTO(const struct i2c_client *client, int res, int temperature,
+		 int humidity, u32 seq),
+	TP_ARGS(client, res, temperature, humidity, seq),
+	TP_STRUCT__entry(
+		AM2320_TP_STRUCT__client
+		__field(int, res)
+		__field(int, temperature)
+		__field(int, humidity)
+		__field(u32, seq)
+	),
+	TP_fast_assign(
+		AM2320_TP_fast_assign_client(client);
+		__entry->res = res;
+		__entry->temperature = temperature;
+		__entry->humidity = humidity;
+		__entry->seq = seq;
+	),
+	TP_printk(AM2320_TP_printk_client
+		  " res=%d temperature=%d humidity=%d seq=%u",
+		  AM2320_TP_printk_client_args, __entry->res,
+		  __entry->temperature, __entry->humidity, __entry->seq)
+);
+
+#endif /* _AM2320_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE am2320_trace
+#include <trace/define_trace.h>